@@ -0,0 +1,306 @@
+#include "framing.h"
+#include "soft_uart.h"
+
+#include <linux/crc-ccitt.h>
+
+#define HDLC_FLAG     0x7E
+#define HDLC_ESCAPE   0x7D
+#define HDLC_XOR      0x20
+
+#define SLIP_END      0xC0
+#define SLIP_ESC      0xDB
+#define SLIP_ESC_END  0xDC
+#define SLIP_ESC_ESC  0xDD
+
+#define COBS_DELIMITER  0x00
+
+// CRC-16/X.25 (as in HDLC): residue of a frame followed by its complemented CRC.
+#define CRC_INIT      0xFFFF
+#define CRC_GOOD      0xF0B8
+#define CRC_SIZE      2
+
+static int end_frame(struct framing_decoder* decoder);
+static int cobs_decode(unsigned char* data, int size);
+static int put_escaped(int mode, unsigned char character, unsigned char* frame, int length, int frame_size);
+
+/**
+ * Initializes a given frame decoder.
+ * @param decoder given decoder
+ * @param mode SOFT_UART_FRAMING_* mode
+ */
+void framing_reset(struct framing_decoder* decoder, int mode)
+{
+  decoder->mode     = mode;
+  decoder->length   = 0;
+  decoder->escaped  = false;
+  decoder->overflow = false;
+}
+
+/**
+ * Feeds a given (received) character into a given frame decoder.
+ * @param decoder given decoder
+ * @param character given character
+ * @return The payload size of a complete frame with a good CRC (possibly 0),
+ * whose payload is then in decoder->data. FRAMING_BAD_FRAME if a bad frame was
+ * dropped. FRAMING_IN_PROGRESS otherwise.
+ */
+int framing_decode(struct framing_decoder* decoder, unsigned char character)
+{
+  int result;
+
+  if (character == framing_get_delimiter(decoder->mode))
+  {
+    result = end_frame(decoder);
+    decoder->length   = 0;
+    decoder->escaped  = false;
+    decoder->overflow = false;
+    return result;
+  }
+
+  if (decoder->mode == SOFT_UART_FRAMING_HDLC)
+  {
+    if (character == HDLC_ESCAPE)
+    {
+      decoder->escaped = true;
+      return FRAMING_IN_PROGRESS;
+    }
+    if (decoder->escaped)
+    {
+      character ^= HDLC_XOR;
+      decoder->escaped = false;
+    }
+  }
+  else if (decoder->mode == SOFT_UART_FRAMING_SLIP)
+  {
+    if (character == SLIP_ESC)
+    {
+      decoder->escaped = true;
+      return FRAMING_IN_PROGRESS;
+    }
+    if (decoder->escaped)
+    {
+      if (character == SLIP_ESC_END)
+      {
+        character = SLIP_END;
+      }
+      else if (character == SLIP_ESC_ESC)
+      {
+        character = SLIP_ESC;
+      }
+      else
+      {
+        decoder->overflow = true; // Invalid escape: the frame is bad.
+      }
+      decoder->escaped = false;
+    }
+  }
+
+  if (decoder->length < FRAMING_MAX_FRAME)
+  {
+    decoder->data[decoder->length++] = character;
+  }
+  else
+  {
+    decoder->overflow = true;
+  }
+  return FRAMING_IN_PROGRESS;
+}
+
+/**
+ * Encodes a given payload into a frame: appends the CRC, escapes the data and
+ * adds the delimiters.
+ * @param mode SOFT_UART_FRAMING_* mode
+ * @param data given payload
+ * @param size size of the given payload
+ * @param frame where the frame is written to
+ * @param frame_size size of the frame buffer
+ * @return The size of the frame. -1 if it does not fit in the frame buffer.
+ */
+int framing_encode(int mode, const unsigned char* data, int size, unsigned char* frame, int frame_size)
+{
+  unsigned short crc = ~crc_ccitt(CRC_INIT, data, size);
+  unsigned char character;
+  int delimiter = framing_get_delimiter(mode);
+  int length = 0;
+  int code_position = 0;
+  int code = 1;
+  int i;
+
+  if (delimiter < 0 || frame_size < 2)
+  {
+    return -1;
+  }
+
+  frame[length++] = delimiter;
+
+  if (mode == SOFT_UART_FRAMING_COBS)
+  {
+    code_position = length++;
+  }
+
+  for (i = 0; i < size + CRC_SIZE && length >= 0; i++)
+  {
+    character = (i < size) ? data[i] : (i == size) ? (crc & 0xFF) : (crc >> 8);
+
+    if (mode != SOFT_UART_FRAMING_COBS)
+    {
+      length = put_escaped(mode, character, frame, length, frame_size);
+    }
+    else if (length >= frame_size)
+    {
+      length = -1;
+    }
+    else if (character == COBS_DELIMITER)
+    {
+      frame[code_position] = code;
+      code_position = length++;
+      code = 1;
+    }
+    else
+    {
+      frame[length++] = character;
+      if (++code == 0xFF)
+      {
+        frame[code_position] = code;
+        code_position = length++;
+        code = 1;
+      }
+    }
+  }
+
+  if (length < 0 || length >= frame_size)
+  {
+    return -1;
+  }
+
+  if (mode == SOFT_UART_FRAMING_COBS)
+  {
+    frame[code_position] = code;
+  }
+  frame[length++] = delimiter;
+  return length;
+}
+
+/**
+ * Gets the frame delimiter of a given framing mode.
+ * @param mode SOFT_UART_FRAMING_* mode
+ * @return The delimiter. -1 if the mode has no frames.
+ */
+int framing_get_delimiter(int mode)
+{
+  switch (mode)
+  {
+    case SOFT_UART_FRAMING_SLIP:
+      return SLIP_END;
+    case SOFT_UART_FRAMING_COBS:
+      return COBS_DELIMITER;
+    case SOFT_UART_FRAMING_HDLC:
+      return HDLC_FLAG;
+    default:
+      return -1;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Internals
+//-----------------------------------------------------------------------------
+
+/**
+ * Completes the frame accumulated in a given decoder and checks its CRC.
+ * Back-to-back delimiters (no bytes at all, not even a CRC) are ignored.
+ * @param decoder given decoder
+ * @return The payload size if the frame is good, FRAMING_BAD_FRAME if it is
+ * bad. FRAMING_IN_PROGRESS if there is no frame.
+ */
+static int end_frame(struct framing_decoder* decoder)
+{
+  int length = decoder->length;
+
+  if (length == 0 && !decoder->overflow)
+  {
+    return FRAMING_IN_PROGRESS;
+  }
+
+  if (decoder->mode == SOFT_UART_FRAMING_COBS && !decoder->overflow)
+  {
+    length = cobs_decode(decoder->data, length);
+  }
+
+  if (decoder->overflow || decoder->escaped || length < CRC_SIZE
+    || crc_ccitt(CRC_INIT, decoder->data, length) != CRC_GOOD)
+  {
+    return FRAMING_BAD_FRAME;
+  }
+
+  return length - CRC_SIZE;
+}
+
+/**
+ * Decodes a given COBS block in place.
+ * @param data given block, without the delimiter
+ * @param size size of the given block
+ * @return The size of the decoded data. -1 if the block is malformed.
+ */
+static int cobs_decode(unsigned char* data, int size)
+{
+  int input = 0;
+  int output = 0;
+  int code;
+  int i;
+
+  while (input < size)
+  {
+    code = data[input++];
+    if (code == 0 || input + code - 1 > size)
+    {
+      return -1;
+    }
+    for (i = 1; i < code; i++)
+    {
+      data[output++] = data[input++];
+    }
+    if (code != 0xFF && input < size)
+    {
+      data[output++] = 0;
+    }
+  }
+  return output;
+}
+
+/**
+ * Appends a given character to a frame, escaping it if needed.
+ * @param mode SOFT_UART_FRAMING_HDLC or SOFT_UART_FRAMING_SLIP
+ * @param character given character
+ * @param frame given frame
+ * @param length current length of the frame
+ * @param frame_size size of the frame buffer
+ * @return The new length of the frame. -1 if it does not fit.
+ */
+static int put_escaped(int mode, unsigned char character, unsigned char* frame, int length, int frame_size)
+{
+  if (length + 2 > frame_size)
+  {
+    return -1;
+  }
+
+  if (mode == SOFT_UART_FRAMING_HDLC && (character == HDLC_FLAG || character == HDLC_ESCAPE))
+  {
+    frame[length++] = HDLC_ESCAPE;
+    frame[length++] = character ^ HDLC_XOR;
+  }
+  else if (mode == SOFT_UART_FRAMING_SLIP && character == SLIP_END)
+  {
+    frame[length++] = SLIP_ESC;
+    frame[length++] = SLIP_ESC_END;
+  }
+  else if (mode == SOFT_UART_FRAMING_SLIP && character == SLIP_ESC)
+  {
+    frame[length++] = SLIP_ESC;
+    frame[length++] = SLIP_ESC_ESC;
+  }
+  else
+  {
+    frame[length++] = character;
+  }
+  return length;
+}
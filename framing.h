@@ -0,0 +1,26 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <linux/types.h>
+
+#define FRAMING_MAX_FRAME  512
+
+// Results of framing_decode(), besides the payload size of a good frame.
+#define FRAMING_IN_PROGRESS  -1
+#define FRAMING_BAD_FRAME    -2
+
+struct framing_decoder
+{
+  int mode;
+  int length;
+  bool escaped;
+  bool overflow;
+  unsigned char data[FRAMING_MAX_FRAME];
+};
+
+void framing_reset(struct framing_decoder* decoder, int mode);
+int  framing_decode(struct framing_decoder* decoder, unsigned char character);
+int  framing_encode(int mode, const unsigned char* data, int size, unsigned char* frame, int frame_size);
+int  framing_get_delimiter(int mode);
+
+#endif
@@ -1,29 +1,81 @@
 
 #include "raspberry_soft_uart.h"
+#include "queue.h"
+#include "raw_device.h"
+#include "soft_uart.h"
 
 #include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/platform_device.h>
+#include <linux/seq_file.h>
+#include <linux/serial.h>
+#include <linux/slab.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
+#include <linux/uaccess.h>
 #include <linux/version.h>
 
 #define SOFT_UART_MAJOR            0
 #define N_PORTS                    1
 #define NONE                       0
 #define TX_BUFFER_FLUSH_TIMEOUT 4000  // milliseconds
+#define BAUD_BASE             115200
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Adriano Marto Reis");
 MODULE_DESCRIPTION("Software-UART for Raspberry Pi");
 MODULE_VERSION("0.2");
 
+// Parameters that can also be changed at run time, through sysfs.
+static int  soft_uart_set_param(const char*, const struct kernel_param*);
+
+static const struct kernel_param_ops soft_uart_param_ops = {
+  .set = soft_uart_set_param,
+  .get = param_get_int
+};
+
+// Whether the parameters take effect immediately (after the initialization).
+static bool initialized = false;
+
 static int gpio_tx = 17;
-module_param(gpio_tx, int, 0);
+module_param_cb(gpio_tx, &soft_uart_param_ops, &gpio_tx, 0644);
 
 static int gpio_rx = 27;
-module_param(gpio_rx, int, 0);
+module_param_cb(gpio_rx, &soft_uart_param_ops, &gpio_rx, 0644);
+
+static int gpio_clk = -1;
+module_param(gpio_clk, int, 0);
+
+static int sync_mode = SOFT_UART_SYNC_OFF;
+module_param(sync_mode, int, 0);
+
+static int raw_rx_size = 4096;
+module_param(raw_rx_size, int, 0);
+
+static int rx_buffer_size = 4096;
+module_param_cb(rx_buffer_size, &soft_uart_param_ops, &rx_buffer_size, 0644);
+
+static int glitch_ns = 0;
+module_param_cb(glitch_ns, &soft_uart_param_ops, &glitch_ns, 0644);
+
+static int instrumentation = 0;
+module_param_cb(instrumentation, &soft_uart_param_ops, &instrumentation, 0644);
+
+static int calibrate = 0;
+module_param_cb(calibrate, &soft_uart_param_ops, &calibrate, 0644);
+
+static int enforce_max_baudrate = 0;
+module_param_cb(enforce_max_baudrate, &soft_uart_param_ops, &enforce_max_baudrate, 0644);
+
+// Settings that only come from the device tree.
+static int default_baudrate = 4800;
+static int line_coding = SOFT_UART_CODING_NRZ;
 
 // Module prototypes.
+static int  soft_uart_start_port(void);
+static void soft_uart_stop_port(void);
 static int  soft_uart_open(struct tty_struct*, struct file*);
 static void soft_uart_close(struct tty_struct*, struct file*);
 static int  soft_uart_write(struct tty_struct*, const unsigned char*, int);
@@ -39,6 +91,13 @@ static int  soft_uart_tiocmset(struct tty_struct*, unsigned int, unsigned int);
 static int  soft_uart_ioctl(struct tty_struct*, unsigned int, unsigned int long);
 static void soft_uart_throttle(struct tty_struct*);
 static void soft_uart_unthrottle(struct tty_struct*);
+static int  soft_uart_send_packet(struct soft_uart_packet __user*);
+static int  soft_uart_get_icount(struct tty_struct*, struct serial_icounter_struct*);
+static int  soft_uart_get_serial(struct tty_struct*, struct serial_struct*);
+static int  soft_uart_set_serial(struct tty_struct*, struct serial_struct*);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+static int  soft_uart_proc_show(struct seq_file*, void*);
+#endif
 
 // Module operations.
 static const struct tty_operations soft_uart_operations = {
@@ -56,28 +115,219 @@ static const struct tty_operations soft_uart_operations = {
   .tiocmget        = soft_uart_tiocmget,
   .tiocmset        = soft_uart_tiocmset,
   .throttle        = soft_uart_throttle,
-  .unthrottle      = soft_uart_unthrottle
+  .unthrottle      = soft_uart_unthrottle,
+  .get_icount      = soft_uart_get_icount,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+  .get_serial      = soft_uart_get_serial,
+  .set_serial      = soft_uart_set_serial,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+  .proc_show       = soft_uart_proc_show
+#endif
 };
 
+// Serial settings (TIOCGSERIAL/TIOCSSERIAL). With ASYNC_SPD_CUST, 38400 baud
+// stands for baud_base / custom_divisor.
+static int serial_flags = 0;
+static int baud_base = BAUD_BASE;
+static int custom_divisor = 0;
+
 // Driver instance.
 static struct tty_driver* soft_uart_driver = NULL;
 
+// File that holds the TTY open. Further opens are rejected, but the TTY core
+// still calls close() for them, so they must not close the device.
+static struct file* open_file = NULL;
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
 static struct tty_port port;
 #endif
 
+// Device tree binding.
+static int  soft_uart_probe(struct platform_device*);
+static int  soft_uart_remove(struct platform_device*);
+
+static const struct of_device_id soft_uart_of_match[] = {
+  { .compatible = "soft-uart" },
+  { }
+};
+MODULE_DEVICE_TABLE(of, soft_uart_of_match);
+
+static struct platform_driver soft_uart_platform_driver = {
+  .probe  = soft_uart_probe,
+  .remove = soft_uart_remove,
+  .driver = {
+    .name                = "soft_uart",
+    .of_match_table      = soft_uart_of_match,
+    .owner               = THIS_MODULE,
+    // The raw device may still hold the pins: the port only goes away with the
+    // module.
+    .suppress_bind_attrs = true
+  }
+};
+
 /**
- * Module initialization.
+ * Module initialization. If the device tree describes the port (in a node that
+ * is not disabled), it is brought up when the platform device is probed.
+ * Otherwise, it is brought up right away, with the module parameters.
  */
 static int __init soft_uart_init(void)
+{
+  struct device_node* node;
+  bool described = false;
+  int result = platform_driver_register(&soft_uart_platform_driver);
+
+  if (result != NONE)
+  {
+    printk(KERN_ALERT "soft_uart: Failed to register the platform driver.\n");
+    return result;
+  }
+
+  for_each_matching_node(node, soft_uart_of_match)
+  {
+    if (of_device_is_available(node))
+    {
+      described = true;
+      of_node_put(node);
+      break;
+    }
+  }
+  if (described)
+  {
+    return NONE;
+  }
+
+  result = soft_uart_start_port();
+  if (result != NONE)
+  {
+    platform_driver_unregister(&soft_uart_platform_driver);
+  }
+  return result;
+}
+
+/**
+ * Cleanup function that gets called when the module is unloaded.
+ */
+static void __exit soft_uart_exit(void)
+{
+  platform_driver_unregister(&soft_uart_platform_driver);
+  if (initialized)
+  {
+    soft_uart_stop_port();
+  }
+}
+
+/**
+ * Probes a soft UART described in the device tree. The pins come from the
+ * tx-gpios (optional, for an RX-only port), rx-gpios and clk-gpios (optional)
+ * properties. The default baudrate comes from current-speed, and the line
+ * coding from soft-uart,line-coding (SOFT_UART_CODING_*). The probe is
+ * deferred until the GPIO controller is available.
+ */
+static int soft_uart_probe(struct platform_device* pdev)
+{
+  struct device_node* node = pdev->dev.of_node;
+  u32 value;
+  int pin;
+
+  if (initialized)
+  {
+    dev_err(&pdev->dev, "soft_uart: Only one port is supported.\n");
+    return -EBUSY;
+  }
+
+  pin = of_get_named_gpio(node, "rx-gpios", 0);
+  if (pin < 0)
+  {
+    return pin;
+  }
+  gpio_rx = pin;
+
+  pin = of_get_named_gpio(node, "tx-gpios", 0);
+  if (pin == -EPROBE_DEFER)
+  {
+    return pin;
+  }
+  gpio_tx = (pin < 0) ? -1 : pin;
+
+  pin = of_get_named_gpio(node, "clk-gpios", 0);
+  if (pin == -EPROBE_DEFER)
+  {
+    return pin;
+  }
+  gpio_clk = (pin < 0) ? -1 : pin;
+
+  if (of_property_read_u32(node, "current-speed", &value) == 0 && value > 0)
+  {
+    default_baudrate = value;
+  }
+  if (of_property_read_u32(node, "soft-uart,line-coding", &value) == 0)
+  {
+    line_coding = value;
+  }
+  if (of_property_read_u32(node, "soft-uart,sync-mode", &value) == 0)
+  {
+    sync_mode = value;
+  }
+
+  if (of_property_read_bool(node, "rts-gpios") || of_property_read_bool(node, "de-gpios"))
+  {
+    dev_warn(&pdev->dev, "soft_uart: RTS and DE pins are not supported, ignoring them.\n");
+  }
+
+  return soft_uart_start_port();
+}
+
+/**
+ * Removes the soft UART described in the device tree.
+ */
+static int soft_uart_remove(struct platform_device* pdev)
+{
+  if (initialized)
+  {
+    soft_uart_stop_port();
+  }
+  return NONE;
+}
+
+/**
+ * Brings the port up: initializes the soft UART and registers the TTY driver
+ * and the raw device.
+ */
+static int soft_uart_start_port(void)
 {
   printk(KERN_INFO "soft_uart: Initializing module...\n");
   
-  if (!raspberry_soft_uart_init(gpio_tx, gpio_rx))
+  if (!raspberry_soft_uart_init(gpio_tx, gpio_rx, gpio_clk))
   {
     printk(KERN_ALERT "soft_uart: Failed initialize GPIO.\n");
     return -ENOMEM;
   }
+
+  if (!raspberry_soft_uart_set_rx_buffer_size(rx_buffer_size))
+  {
+    printk(KERN_ALERT "soft_uart: Invalid RX buffer size.\n");
+    raspberry_soft_uart_finalize();
+    return -EINVAL;
+  }
+
+  if (!raspberry_soft_uart_set_glitch_filter(glitch_ns))
+  {
+    printk(KERN_ALERT "soft_uart: Invalid glitch filter width.\n");
+    raspberry_soft_uart_finalize();
+    return -EINVAL;
+  }
+
+  // Sets the default baudrate, so the engine runs at a valid rate before any
+  // set_termios: the raw device does not need the TTY open.
+  if (!raspberry_soft_uart_set_baudrate(default_baudrate))
+  {
+    printk(KERN_ALERT "soft_uart: Invalid default baudrate, using 4800.\n");
+    default_baudrate = 4800;
+    raspberry_soft_uart_set_baudrate(default_baudrate);
+  }
+
+  raspberry_soft_uart_set_instrumentation(instrumentation);
     
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
   printk(KERN_INFO "soft_uart: LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0).\n");
@@ -122,6 +372,7 @@ static int __init soft_uart_init(void)
   soft_uart_driver->init_termios.c_ispeed = 4800;
   soft_uart_driver->init_termios.c_ospeed = 4800;
   soft_uart_driver->init_termios.c_cflag  = B4800 | CREAD | CS8 | CLOCAL;
+  tty_termios_encode_baud_rate(&soft_uart_driver->init_termios, default_baudrate, default_baudrate);
 
   // Sets the callbacks for the driver.
   tty_set_operations(soft_uart_driver, &soft_uart_operations);
@@ -139,17 +390,49 @@ static int __init soft_uart_init(void)
     return -1; // return if registration fails
   }
 
+  // Registers the raw device.
+  if (!raw_device_init(raw_rx_size))
+  {
+    printk(KERN_ALERT "soft_uart: Failed to register the raw device.\n");
+    tty_unregister_driver(soft_uart_driver);
+    put_tty_driver(soft_uart_driver);
+    return -1;
+  }
+
+  // Calibrates the timing, while the pins are still free.
+  if (calibrate && !raspberry_soft_uart_calibrate())
+  {
+    printk(KERN_ALERT "soft_uart: Failed to calibrate the timing.\n");
+  }
+
+  // Selects the line coding, if requested.
+  if (!raspberry_soft_uart_set_coding(line_coding))
+  {
+    printk(KERN_ALERT "soft_uart: Invalid line coding, using NRZ.\n");
+  }
+
+  // Selects the synchronous mode, if requested.
+  if (!raspberry_soft_uart_set_sync(sync_mode))
+  {
+    printk(KERN_ALERT "soft_uart: Invalid synchronous mode (or no clock pin), using asynchronous.\n");
+  }
+
+  initialized = true;
   printk(KERN_INFO "soft_uart: Module initialized.\n");
   return 0;
 }
 
 /**
- * Cleanup function that gets called when the module is unloaded.
+ * Takes the port down.
  */
-static void __exit soft_uart_exit(void)
+static void soft_uart_stop_port(void)
 {
   printk(KERN_INFO "soft_uart: Finalizing the module...\n");
+  initialized = false;
   
+  // Deregisters the raw device.
+  raw_device_finalize();
+
   // Finalizes the soft UART.
   if (!raspberry_soft_uart_finalize())
   {
@@ -178,11 +461,12 @@ static int soft_uart_open(struct tty_struct* tty, struct file* file)
     
   if (raspberry_soft_uart_open(tty))
   {
+    open_file = file;
     printk(KERN_INFO "soft_uart: Device opened.\n");
   }
   else
   {
-    printk(KERN_ALERT "soft_uart: Device busy.\n");
+    printk(KERN_ALERT "soft_uart: Device busy, use %s to monitor it.\n", SOFT_UART_RAW_NAME);
     error = -ENODEV;
   }
   
@@ -198,6 +482,14 @@ static void soft_uart_close(struct tty_struct* tty, struct file* file)
 {
   // Waits for the TX buffer to be empty before closing the UART.
   int wait_time = 0;
+
+  // Ignores the close of an open that was rejected.
+  if (file != open_file)
+  {
+    return;
+  }
+  open_file = NULL;
+
   while ((raspberry_soft_uart_get_tx_queue_size() > 0)
     && (wait_time < TX_BUFFER_FLUSH_TIMEOUT))
   {
@@ -224,6 +516,21 @@ static void soft_uart_close(struct tty_struct* tty, struct file* file)
  */
 static int soft_uart_write(struct tty_struct* tty, const unsigned char* buffer, int buffer_size)
 {
+  int result;
+
+  // RX-only ports (no TX pin) cannot transmit.
+  if (raspberry_soft_uart_is_rx_only())
+  {
+    return -EIO;
+  }
+
+  // In a framing mode, every write is one frame.
+  if (raspberry_soft_uart_get_framing() != SOFT_UART_FRAMING_NONE)
+  {
+    result = raspberry_soft_uart_send_frame(buffer, buffer_size);
+    return (result < 0) ? -EMSGSIZE : result;
+  }
+
   return raspberry_soft_uart_send_string(buffer, buffer_size);
 }
 
@@ -238,11 +545,14 @@ static int soft_uart_write_room(struct tty_struct* tty)
 }
 
 /**
- * Does nothing.
+ * Discards the data waiting to be sent, as in tcflush(TCOFLUSH), and wakes up
+ * the writers.
  * @param tty
  */
 static void soft_uart_flush_buffer(struct tty_struct* tty)
 {
+  raspberry_soft_uart_flush_tx();
+  tty_wakeup(tty);
 }
 
 /**
@@ -264,6 +574,14 @@ static void soft_uart_set_termios(struct tty_struct* tty, struct ktermios* termi
 {
   int cflag = 0;
   speed_t baudrate = tty_get_baud_rate(tty);
+  int max_baudrate = raspberry_soft_uart_get_max_baudrate();
+  bool valid = true;
+
+  // Applies the custom divisor set with setserial.
+  if (baudrate == 38400 && (serial_flags & ASYNC_SPD_MASK) == ASYNC_SPD_CUST && custom_divisor > 0)
+  {
+    baudrate = baud_base / custom_divisor;
+  }
   printk(KERN_INFO "soft_uart: soft_uart_set_termios: baudrate = %d.\n", baudrate);
 
   // Gets the cflag.
@@ -292,10 +610,27 @@ static void soft_uart_set_termios(struct tty_struct* tty, struct ktermios* termi
   // Configures parity (enabled or disabled, even or odd, parity errors ignored or not).
   raspberry_soft_uart_set_parity(cflag & PARENB, cflag & PARODD, cflag & IGNPAR);
   
-  // Configure the baudrate.
-  if (!raspberry_soft_uart_set_baudrate(baudrate))
+  // Configure the baudrate. B0 (hang up) keeps the current one, and so does an
+  // invalid one, which is then reported back as the actual speed. With the
+  // policy enforced, rates above the calibrated maximum of the engine are
+  // invalid.
+  if (baudrate != 0 && enforce_max_baudrate && max_baudrate > 0 && baudrate > max_baudrate)
+  {
+    printk(KERN_ALERT "soft_uart: Baudrate above the calibrated maximum (%d).\n", max_baudrate);
+    valid = false;
+  }
+  else if (baudrate != 0 && !raspberry_soft_uart_set_baudrate(baudrate))
   {
     printk(KERN_ALERT "soft_uart: Invalid baudrate.\n");
+    valid = false;
+  }
+  if (!valid)
+  {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+    tty_termios_encode_baud_rate(&tty->termios, raspberry_soft_uart_get_baudrate(), raspberry_soft_uart_get_baudrate());
+#else
+    tty_termios_encode_baud_rate(tty->termios, raspberry_soft_uart_get_baudrate(), raspberry_soft_uart_get_baudrate());
+#endif
   }
 }
 
@@ -326,6 +661,56 @@ static void soft_uart_hangup(struct tty_struct* tty)
   printk(KERN_DEBUG "soft_uart: soft_uart_hangup.\n");
 }
 
+/**
+ * Sends a packet and reports when it went out on the wire.
+ * @param user_packet packet description, in user space
+ * @return error code.
+ */
+static int soft_uart_send_packet(struct soft_uart_packet __user* user_packet)
+{
+  struct soft_uart_packet packet;
+  unsigned char* data = NULL;
+  ktime_t first_start = 0;
+  ktime_t last_stop = 0;
+  int error = NONE;
+
+  if (copy_from_user(&packet, user_packet, sizeof(packet)))
+  {
+    return -EFAULT;
+  }
+  if (packet.size == 0 || packet.size > SOFT_UART_MAX_PACKET)
+  {
+    return -EMSGSIZE;
+  }
+
+  data = kmalloc(packet.size, GFP_KERNEL);
+  if (data == NULL)
+  {
+    return -ENOMEM;
+  }
+
+  if (copy_from_user(data, (const void __user*) (uintptr_t) packet.data, packet.size))
+  {
+    error = -EFAULT;
+  }
+  else
+  {
+    error = raspberry_soft_uart_send_packet(data, packet.size, packet.priority, &first_start, &last_stop);
+  }
+  kfree(data);
+
+  if (error == NONE)
+  {
+    packet.first_start_ns = ktime_to_ns(first_start);
+    packet.last_stop_ns = ktime_to_ns(last_stop);
+    if (copy_to_user(user_packet, &packet, sizeof(packet)))
+    {
+      error = -EFAULT;
+    }
+  }
+  return error;
+}
+
 /**
  * Does nothing.
  * @param tty
@@ -347,7 +732,7 @@ static int soft_uart_tiocmset(struct tty_struct* tty, unsigned int set, unsigned
 }
 
 /**
- * Does nothing.
+ * Handles the soft UART specific commands.
  * @param tty
  * @param command
  * @param parameter
@@ -355,9 +740,85 @@ static int soft_uart_tiocmset(struct tty_struct* tty, unsigned int set, unsigned
 static int soft_uart_ioctl(struct tty_struct* tty, unsigned int command, unsigned int long parameter)
 {
   int error = NONE;
+  int value = 0;
 
   switch (command)
   {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0)
+    case TIOCGSERIAL:
+    {
+      struct serial_struct serial;
+      soft_uart_get_serial(tty, &serial);
+      if (copy_to_user((void __user*) parameter, &serial, sizeof(serial)))
+      {
+        error = -EFAULT;
+      }
+      break;
+    }
+
+    case TIOCSSERIAL:
+    {
+      struct serial_struct serial;
+      if (copy_from_user(&serial, (void __user*) parameter, sizeof(serial)))
+      {
+        error = -EFAULT;
+      }
+      else
+      {
+        error = soft_uart_set_serial(tty, &serial);
+      }
+      break;
+    }
+#endif
+
+    case SOFT_UART_SET_FRAMING:
+      if (get_user(value, (int __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else if (!raspberry_soft_uart_set_framing(value))
+      {
+        error = -EINVAL;
+      }
+      break;
+
+    case SOFT_UART_SEND_PACKET:
+      error = soft_uart_send_packet((struct soft_uart_packet __user*) parameter);
+      break;
+
+    case SOFT_UART_SET_TX_PRIORITY:
+      if (get_user(value, (int __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else if (!raspberry_soft_uart_set_tx_priority(value))
+      {
+        error = -EINVAL;
+      }
+      break;
+
+    case SOFT_UART_SET_SYNC:
+      if (get_user(value, (int __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else if (!raspberry_soft_uart_set_sync(value))
+      {
+        error = -EINVAL;
+      }
+      break;
+
+    case SOFT_UART_SET_CODING:
+      if (get_user(value, (int __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else if (!raspberry_soft_uart_set_coding(value))
+      {
+        error = -EINVAL;
+      }
+      break;
+
     case TIOCMSET:
       error = NONE;
       break;
@@ -375,23 +836,191 @@ static int soft_uart_ioctl(struct tty_struct* tty, unsigned int command, unsigne
 }
 
 /**
- * Does nothing.
+ * Stops pushing received characters to the TTY. They accumulate in the RX
+ * buffer meanwhile.
  * @param tty
  */
 static void soft_uart_throttle(struct tty_struct* tty)
 {
   printk(KERN_DEBUG "soft_uart: soft_uart_throttle.\n");
+  raspberry_soft_uart_set_throttle(1);
 }
 
 /**
- * Does nothing.
+ * Resumes pushing received characters to the TTY.
  * @param tty
  */
 static void soft_uart_unthrottle(struct tty_struct* tty)
 {
   printk(KERN_DEBUG "soft_uart: soft_uart_unthrottle.\n");
+  raspberry_soft_uart_set_throttle(0);
+}
+
+/**
+ * Gets the interrupt counters (TIOCGICOUNT).
+ * @param tty
+ * @param icount where the counters are copied to
+ * @return error code.
+ */
+static int soft_uart_get_icount(struct tty_struct* tty, struct serial_icounter_struct* icount)
+{
+  struct raspberry_soft_uart_counters counters;
+
+  raspberry_soft_uart_get_counters(&counters);
+  memset(icount, 0, sizeof(*icount));
+  icount->rx          = counters.rx;
+  icount->tx          = counters.tx;
+  icount->parity      = counters.parity;
+  icount->frame       = counters.frame;
+  icount->buf_overrun = counters.buf_overrun;
+  return NONE;
+}
+
+/**
+ * Changes a parameter written through sysfs. Before the initialization, the
+ * value is only stored. The pins can only be changed, and the timing
+ * calibrated, while the port is not in use; the buffer size takes effect
+ * on the next open.
+ */
+static int soft_uart_set_param(const char* value, const struct kernel_param* param)
+{
+  int number = 0;
+  int success = 1;
+
+  if (kstrtoint(value, 0, &number))
+  {
+    return -EINVAL;
+  }
+
+  if (initialized)
+  {
+    if (param->arg == &gpio_tx)
+    {
+      success = raspberry_soft_uart_set_pins(number, gpio_rx);
+    }
+    else if (param->arg == &gpio_rx)
+    {
+      success = raspberry_soft_uart_set_pins(gpio_tx, number);
+    }
+    else if (param->arg == &rx_buffer_size)
+    {
+      success = raspberry_soft_uart_set_rx_buffer_size(number);
+    }
+    else if (param->arg == &glitch_ns)
+    {
+      success = raspberry_soft_uart_set_glitch_filter(number);
+    }
+    else if (param->arg == &instrumentation)
+    {
+      success = raspberry_soft_uart_set_instrumentation(number);
+    }
+    else if (param->arg == &calibrate && number)
+    {
+      success = raspberry_soft_uart_calibrate();
+    }
+  }
+
+  if (!success)
+  {
+    return (param->arg == &gpio_tx || param->arg == &gpio_rx || param->arg == &calibrate) ? -EBUSY : -EINVAL;
+  }
+  return param_set_int(value, param);
+}
+
+/**
+ * Reports the serial settings (TIOCGSERIAL). The transmit FIFO is the TX
+ * buffer, and the IRQ is the one of the RX pin.
+ * @param tty given TTY
+ * @param serial where the settings are written to
+ * @return error code.
+ */
+static int soft_uart_get_serial(struct tty_struct* tty, struct serial_struct* serial)
+{
+  memset(serial, 0, sizeof(*serial));
+  serial->type           = PORT_UNKNOWN;
+  serial->line           = 0;
+  serial->irq            = raspberry_soft_uart_get_rx_irq();
+  serial->flags          = serial_flags;
+  serial->xmit_fifo_size = QUEUE_MAX_SIZE;
+  serial->baud_base      = baud_base;
+  serial->custom_divisor = custom_divisor;
+  return NONE;
+}
+
+/**
+ * Changes the serial settings (TIOCSSERIAL): the baud base (administrators
+ * only), the custom divisor and the speed flags. The baudrate is applied again
+ * right away. The other settings are fixed, and ignored.
+ * @param tty given TTY
+ * @param serial new settings
+ * @return error code.
+ */
+static int soft_uart_set_serial(struct tty_struct* tty, struct serial_struct* serial)
+{
+  if (serial->baud_base <= 0 || serial->custom_divisor < 0)
+  {
+    return -EINVAL;
+  }
+  if (serial->baud_base != baud_base && !capable(CAP_SYS_ADMIN))
+  {
+    return -EPERM;
+  }
+
+  baud_base = serial->baud_base;
+  custom_divisor = serial->custom_divisor;
+  serial_flags = (serial_flags & ~ASYNC_SPD_MASK) | (serial->flags & ASYNC_SPD_MASK);
+  soft_uart_set_termios(tty, NULL);
+  return NONE;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+/**
+ * Describes the port in /proc/tty/driver/soft_uart, in the format of the
+ * hardware serial drivers, plus the soft UART specifics: pins, engine, error
+ * counters, the worst timer lateness seen so far, and the calibrated timing.
+ * @param file given seq_file
+ * @param data unused
+ * @return error code.
+ */
+static int soft_uart_proc_show(struct seq_file* file, void* data)
+{
+  struct raspberry_soft_uart_counters counters;
+  struct raspberry_soft_uart_calibration calibration;
+  int i;
+
+  raspberry_soft_uart_get_counters(&counters);
+  raspberry_soft_uart_get_calibration(&calibration);
+  seq_printf(file, "serinfo:1.0 driver:soft_uart revision:0.2\n");
+  seq_printf(file, "0: uart:soft gpio_tx:%d gpio_rx:%d baud:%d engine:%s",
+    gpio_tx, gpio_rx, raspberry_soft_uart_get_baudrate(), raspberry_soft_uart_get_engine_name());
+  seq_printf(file, " tx:%u rx:%u fe:%u pe:%u oe:%u badframe:%u glitch:%u relocks:%u",
+    counters.tx, counters.rx, counters.frame, counters.parity, counters.buf_overrun,
+    counters.bad_frames, counters.glitches, counters.relocks);
+  seq_printf(file, " relock_us:%u", counters.last_relock_us);
+
+  // Timer lateness, only measured with the instrumentation on.
+  if (instrumentation)
+  {
+    seq_printf(file, " late_max_ns:%u late_hist:", counters.max_lateness_ns);
+    for (i = 0; i < RASPBERRY_SOFT_UART_LATENESS_BUCKETS; i++)
+    {
+      seq_printf(file, i == 0 ? "%u" : "/%u", counters.lateness[i]);
+    }
+  }
+
+  // Calibrated timing, and the fastest baudrate of every engine.
+  if (calibration.max_baudrate_nrz > 0)
+  {
+    seq_printf(file, " cal_late_max_ns:%u cal_pin_ns:%u/%u max_baud:%d max_baud_engines:%d/%d/%d/%d",
+      calibration.max_lateness_ns, calibration.pin_read_ns, calibration.pin_write_ns,
+      raspberry_soft_uart_get_max_baudrate(), calibration.max_baudrate_nrz, calibration.max_baudrate_irda,
+      calibration.max_baudrate_manchester, calibration.max_baudrate_sync_master);
+  }
+  seq_printf(file, "\n");
+  return NONE;
+}
+#endif
+
 // Module entry points.
 module_init(soft_uart_init);
 module_exit(soft_uart_exit);
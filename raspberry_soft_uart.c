@@ -1,49 +1,177 @@
 
 #include "raspberry_soft_uart.h"
+#include "framing.h"
 #include "queue.h"
+#include "raw_device.h"
+#include "soft_uart.h"
+#include "soft_uart_core.h"
 
 #include <linux/gpio.h> 
+#include <linux/gpio/consumer.h>
 #include <linux/hrtimer.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/jump_label.h>
 #include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
 #include <linux/tty.h>
 #include <linux/tty_flip.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 static irq_handler_t handle_rx_start(unsigned int irq, void* device, struct pt_regs* registers);
+static irq_handler_t handle_clock(unsigned int irq, void* device, struct pt_regs* registers);
 static enum hrtimer_restart handle_tx(struct hrtimer* timer);
 static enum hrtimer_restart handle_rx(struct hrtimer* timer);
-static void receive_character(unsigned char character);
+static bool hunt_idle(int bit_value, ktime_t current_time);
+static enum hrtimer_restart handle_calibration(struct hrtimer* timer);
+static void record_lateness(struct hrtimer* timer, ktime_t current_time, unsigned int* max_lateness_ns, unsigned int* histogram);
+static int get_safe_baudrate(unsigned int error_ns, int budget_num, int budget_den);
+static bool handle_sync_master(ktime_t current_time, bool* must_sample);
+static bool handle_irda_tx(ktime_t current_time, ktime_t* interval);
+static void handle_irda_pulse(ktime_t current_time);
+static void decode_irda_frame(void);
+static bool handle_manchester_tx(ktime_t current_time, ktime_t* interval);
+static void handle_manchester_edge(ktime_t current_time, int level);
+static bool is_launch_edge(int clock_level);
+static void sample_sync_rx(ktime_t current_time);
+static int tx_next_bit(ktime_t current_time);
+static bool rx_next_bit(int bit_value);
+static void receive_character(unsigned char character, ktime_t timestamp);
+static void push_rx_characters(struct work_struct* work);
+static void wake_up_writers(struct work_struct* work);
+static int enqueue_tx(const unsigned char* string, int string_size, int priority, bool all_or_nothing);
+static void push_rx_string(const unsigned char* string, int string_size);
+static void push_rx_frame(const unsigned char* payload, int payload_size);
+static int dequeue_tx(unsigned char* character);
+static int get_tx_size(void);
+static void abort_tx_packet(void);
+static int add_rx_user(void);
+static void remove_rx_user(void);
+static void apply_glitch_filter(void);
+static int acquire_pins(void);
+static void release_pins(void);
 
-static struct queue queue_tx;
+static struct queue queue_tx[SOFT_UART_TX_PRIORITIES];
+static DEFINE_SPINLOCK(queue_tx_lock);
+static int tx_priority = SOFT_UART_TX_PRIORITY_NORMAL;
+static int tx_locked_priority = -1;
+static struct soft_uart_core_tx tx = { 0, -1, 0 };
+static unsigned int tx_dequeued[SOFT_UART_TX_PRIORITIES];
+static bool tx_character_is_first = false;
+static bool tx_character_is_last = false;
+
+// Packet being sent by raspberry_soft_uart_send_packet(). Its characters are
+// identified by their sequence numbers in the TX queue.
+static DEFINE_MUTEX(tx_packet_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(tx_packet_wait);
+static struct
+{
+  bool pending;
+  bool started;
+  bool sent_last;
+  bool done;
+  bool aborted;
+  int priority;
+  unsigned int first;
+  unsigned int last;
+  ktime_t first_start;
+  ktime_t last_stop;
+} tx_packet;
 static struct tty_struct* current_tty = NULL;
 static DEFINE_MUTEX(current_tty_mutex);
 static struct hrtimer timer_tx;
 static struct hrtimer timer_rx;
 static ktime_t period;
 static ktime_t half_period;
+static int current_baudrate = 0;
 static int gpio_tx = 0;
 static int gpio_rx = 0;
-static int rx_bit_index = -1;
+static int gpio_clk = -1;
+
+// Descriptors of the pins, looked up once when they are acquired, so the
+// engines use the raw accessors directly.
+static struct gpio_desc* gpio_tx_desc = NULL;
+static struct gpio_desc* gpio_rx_desc = NULL;
+static struct gpio_desc* gpio_clk_desc = NULL;
+
+// The TX and RX pins and the RX interruption are only held while in use.
+static bool pins_acquired = false;
+static int sync_mode = SOFT_UART_SYNC_OFF;
+static bool sync_sample_phase = false;
+static int line_coding = SOFT_UART_CODING_NRZ;
+static ktime_t pulse_width;
+static bool tx_pulse_on = false;
+static bool rx_frame_active = false;
+static unsigned int rx_pulse_slots = 0;
+static bool tx_second_half = false;
+static int tx_manchester_bit = 0;
+static ktime_t rx_last_mid;
+static ktime_t rx_last_edge;
+static int glitch_ns = 0;
+static ktime_t rx_glitch;
+static ktime_t rx_debounce;
+static bool rx_confirming_start = false;
+static struct soft_uart_core_rx rx = { -1, 0, 0, true, true };
+static int rx_frame_errors_in_row = 0;
+static bool rx_hunting = false;
+static int rx_mark_bits = 0;
+static ktime_t rx_hunt_start;
+static ktime_t rx_start_time;
+static int rx_users = 0;
 static void (*rx_callback)(unsigned char) = NULL;
 static int stop_bits = 1;
 static int parity_en = 0;
+static int parity_odd = 0;
 static int ignore_parity_errors = 0;
+static struct raspberry_soft_uart_counters counters;
 
-static int parity_init = 0;
-static int final_stop_bit_index = 8;
-static int parity_index = -1;
+// Optional instrumentation of the timers. While disabled, its branch in the
+// handlers is patched out.
+static DEFINE_STATIC_KEY_FALSE(instrumentation);
+
+// Calibration of the host: a timer runs at a typical bit period for a while,
+// with the pin access of the RX timer, and its lateness is measured.
+#define CALIBRATION_PERIOD_NS     100000
+#define CALIBRATION_EXPIRIES      2000
+#define CALIBRATION_PIN_ACCESSES  256
+static struct hrtimer timer_calibration;
+static DECLARE_WAIT_QUEUE_HEAD(calibration_wait);
+static int calibration_expiries = 0;
+static struct raspberry_soft_uart_calibration calibration;
+
+// RX buffer between the decoder and the TTY. Head and tail are free-running.
+static DEFINE_SPINLOCK(rx_buffer_lock);
+static DECLARE_WORK(rx_work, push_rx_characters);
+static DECLARE_WORK(tx_wakeup_work, wake_up_writers);
+static unsigned char* rx_buffer = NULL;
+// Size of the RX buffer in use, and of the one allocated by the next open.
+static unsigned int rx_buffer_size = 4096;
+static unsigned int rx_buffer_next_size = 4096;
+static unsigned int rx_head = 0;
+static unsigned int rx_tail = 0;
+static bool rx_throttled = false;
+static struct framing_decoder rx_framing;
+static int framing_mode = SOFT_UART_FRAMING_NONE;
+
+static struct soft_uart_core_frame char_format = { 0, -1, 8, 0 };
 
 /**
  * Initializes the Raspberry Soft UART infrastructure.
  * This must be called during the module initialization.
- * The GPIO pin used as TX is configured as output.
- * The GPIO pin used as RX is configured as input.
- * @param gpio_tx GPIO pin used as TX
+ * The TX and RX pins are only acquired when the port is first used: the pin
+ * used as TX is then configured as output, and the pin used as RX as input.
+ * The GPIO pin used as clock (if any) is configured as input until a
+ * synchronous mode is selected.
+ * @param gpio_tx GPIO pin used as TX, or a negative number for an RX-only port
  * @param gpio_rx GPIO pin used as RX
+ * @param gpio_clk GPIO pin used as clock, or a negative number for none
  * @return 1 if the initialization is successful. 0 otherwise.
  */
-int raspberry_soft_uart_init(const int _gpio_tx, const int _gpio_rx)
+int raspberry_soft_uart_init(const int _gpio_tx, const int _gpio_rx, const int _gpio_clk)
 {
   bool success = true;
   
@@ -56,25 +184,31 @@ int raspberry_soft_uart_init(const int _gpio_tx, const int _gpio_rx)
   // Initializes the RX timer.
   hrtimer_init(&timer_rx, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
   timer_rx.function = &handle_rx;
+
+  // Initializes the calibration timer.
+  hrtimer_init(&timer_calibration, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  timer_calibration.function = &handle_calibration;
   
-  // Initializes the GPIO pins.
+  // Checks the GPIO pins, which are acquired later.
   gpio_tx = _gpio_tx;
   gpio_rx = _gpio_rx;
-    
-  success &= gpio_request(gpio_tx, "soft_uart_tx") == 0;
-  success &= gpio_direction_output(gpio_tx, 1) == 0;
+  gpio_clk = _gpio_clk;
+  success &= gpio_is_valid(gpio_rx) && (gpio_tx < 0 || gpio_is_valid(gpio_tx));
 
-  success &= gpio_request(gpio_rx, "soft_uart_rx") == 0;
-  success &= gpio_direction_input(gpio_rx) == 0;
-  
-  // Initializes the interruption.
-  success &= request_irq(
-    gpio_to_irq(gpio_rx),
-    (irq_handler_t) handle_rx_start,
-    IRQF_TRIGGER_FALLING,
-    "soft_uart_irq_handler",
-    NULL) == 0;
-  disable_irq(gpio_to_irq(gpio_rx));
+  // Initializes the clock (both edges matter in synchronous slave mode).
+  if (gpio_clk >= 0)
+  {
+    success &= gpio_request(gpio_clk, "soft_uart_clk") == 0;
+    success &= gpio_direction_input(gpio_clk) == 0;
+    gpio_clk_desc = gpio_to_desc(gpio_clk);
+    success &= request_irq(
+      gpio_to_irq(gpio_clk),
+      (irq_handler_t) handle_clock,
+      IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+      "soft_uart_clk_irq_handler",
+      NULL) == 0;
+    disable_irq(gpio_to_irq(gpio_clk));
+  }
     
   return success;
 }
@@ -84,13 +218,46 @@ int raspberry_soft_uart_init(const int _gpio_tx, const int _gpio_rx)
  */
 int raspberry_soft_uart_finalize(void)
 {
-  free_irq(gpio_to_irq(gpio_rx), NULL);
-  gpio_set_value(gpio_tx, 0);
-  gpio_free(gpio_tx);
-  gpio_free(gpio_rx);
+  if (pins_acquired)
+  {
+    release_pins();
+  }
+  if (gpio_clk >= 0)
+  {
+    free_irq(gpio_to_irq(gpio_clk), NULL);
+    gpio_free(gpio_clk);
+  }
   return 1;
 }
 
+/**
+ * Moves the Soft UART to other TX and RX pins. The port must not be in use
+ * (open or monitored by the raw device), so the pins are not held;
+ * the new ones are acquired when the port is next used.
+ * @param _gpio_tx GPIO pin used as TX, or a negative number for an RX-only port
+ * @param _gpio_rx GPIO pin used as RX
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_pins(const int _gpio_tx, const int _gpio_rx)
+{
+  int success = 0;
+
+  if (!gpio_is_valid(_gpio_rx) || (_gpio_tx >= 0 && !gpio_is_valid(_gpio_tx)))
+  {
+    return 0;
+  }
+
+  mutex_lock(&current_tty_mutex);
+  if (current_tty == NULL && rx_users == 0)
+  {
+    gpio_tx = _gpio_tx;
+    gpio_rx = _gpio_rx;
+    success = 1;
+  }
+  mutex_unlock(&current_tty_mutex);
+  return success;
+}
+
 /**
  * Opens the Soft UART.
  * @param tty
@@ -99,16 +266,38 @@ int raspberry_soft_uart_finalize(void)
 int raspberry_soft_uart_open(struct tty_struct* tty)
 {
   int success = 0;
+  int i;
+  unsigned int buffer_size = rx_buffer_next_size;
+  unsigned char* buffer = vmalloc(buffer_size);
+  if (buffer == NULL)
+  {
+    printk(KERN_ALERT "soft_uart: Failed to allocate the RX buffer.\n");
+    return 0;
+  }
+
   mutex_lock(&current_tty_mutex);
-  rx_bit_index = -1;
-  if (current_tty == NULL)
+  if (current_tty == NULL && add_rx_user())
   {
     current_tty = tty;
-    initialize_queue(&queue_tx);
+    spin_lock_irq(&rx_buffer_lock);
+    rx_buffer = buffer;
+    rx_buffer_size = buffer_size;
+    rx_head = 0;
+    rx_tail = 0;
+    rx_throttled = false;
+    spin_unlock_irq(&rx_buffer_lock);
+    buffer = NULL;
+    spin_lock_irq(&queue_tx_lock);
+    for (i = 0; i < SOFT_UART_TX_PRIORITIES; i++)
+    {
+      initialize_queue(&queue_tx[i]);
+    }
+    tx_locked_priority = -1;
+    spin_unlock_irq(&queue_tx_lock);
     success = 1;
-    enable_irq(gpio_to_irq(gpio_rx));
   }
   mutex_unlock(&current_tty_mutex);
+  vfree(buffer);
   return success;
 }
 
@@ -117,40 +306,279 @@ int raspberry_soft_uart_open(struct tty_struct* tty)
  */
 int raspberry_soft_uart_close(void)
 {
+  unsigned char* buffer = NULL;
+
   mutex_lock(&current_tty_mutex);
-  disable_irq(gpio_to_irq(gpio_rx));
-  hrtimer_cancel(&timer_tx);
-  hrtimer_cancel(&timer_rx);
-  current_tty = NULL;
+  if (current_tty != NULL)
+  {
+    remove_rx_user();
+    hrtimer_cancel(&timer_tx);
+    current_tty = NULL;
+
+    // Aborts the packet being sent, if any.
+    spin_lock_irq(&queue_tx_lock);
+    abort_tx_packet();
+    spin_unlock_irq(&queue_tx_lock);
+    wake_up_interruptible(&tx_packet_wait);
+
+    spin_lock_irq(&rx_buffer_lock);
+    buffer = rx_buffer;
+    rx_buffer = NULL;
+    spin_unlock_irq(&rx_buffer_lock);
+  }
+  mutex_unlock(&current_tty_mutex);
+
+  cancel_work_sync(&rx_work);
+  cancel_work_sync(&tx_wakeup_work);
+  vfree(buffer);
+  return 1;
+}
+
+/**
+ * Sets the size of the RX buffer that sits between the decoder and the TTY.
+ * It absorbs stalls of the reader. It takes effect on the next open.
+ * @param size size in bytes (rounded up to a power of two)
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_rx_buffer_size(const int size)
+{
+  if (size <= 0 || size > (64 << 20))
+  {
+    return 0;
+  }
+  rx_buffer_next_size = roundup_pow_of_two(size);
+  return 1;
+}
+
+/**
+ * Stops or resumes pushing received characters to the TTY. While throttled,
+ * received characters accumulate in the RX buffer.
+ * @param throttled 1 to stop, 0 to resume
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_throttle(int throttled)
+{
+  spin_lock_irq(&rx_buffer_lock);
+  rx_throttled = throttled;
+  spin_unlock_irq(&rx_buffer_lock);
+  if (!throttled)
+  {
+    schedule_work(&rx_work);
+  }
+  return 1;
+}
+
+/**
+ * Gets the interrupt counters.
+ * @param _counters where the counters are copied to
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_get_counters(struct raspberry_soft_uart_counters* _counters)
+{
+  *_counters = counters;
+  return 1;
+}
+
+/**
+ * Enables or disables the optional instrumentation of the timers (lateness).
+ * Enabling it starts the measurements afresh.
+ * @param enabled whether the instrumentation is enabled
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_instrumentation(int enabled)
+{
+  if (enabled && !static_branch_unlikely(&instrumentation))
+  {
+    counters.max_lateness_ns = 0;
+    memset(counters.lateness, 0, sizeof(counters.lateness));
+    static_branch_enable(&instrumentation);
+  }
+  else if (!enabled)
+  {
+    static_branch_disable(&instrumentation);
+  }
+  return 1;
+}
+
+/**
+ * Measures the timing of the host: the cost of the pin accesses, and the
+ * lateness of the timers while they do them. From the worst timing error, it
+ * works out the fastest baudrate of every engine at which the error stays
+ * within the budget of the engine. It takes about 0.2 s, and the pins, so the
+ * port must not be in use.
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_calibrate(void)
+{
+  unsigned long flags;
+  unsigned int error_ns;
+  ktime_t start;
+  int i;
+
+  mutex_lock(&current_tty_mutex);
+  if (rx_users != 0 || !acquire_pins())
+  {
+    mutex_unlock(&current_tty_mutex);
+    return 0;
+  }
+
+  // Cost of the pin accesses. TX is written its idle level.
+  local_irq_save(flags);
+  start = ktime_get();
+  for (i = 0; i < CALIBRATION_PIN_ACCESSES; i++)
+  {
+    gpiod_get_raw_value(gpio_rx_desc);
+  }
+  calibration.pin_read_ns = (unsigned int) ktime_to_ns(ktime_sub(ktime_get(), start)) / CALIBRATION_PIN_ACCESSES;
+  calibration.pin_write_ns = 0;
+  if (gpio_tx >= 0)
+  {
+    start = ktime_get();
+    for (i = 0; i < CALIBRATION_PIN_ACCESSES; i++)
+    {
+      gpiod_set_raw_value(gpio_tx_desc, (line_coding == SOFT_UART_CODING_NRZ) ? 1 : 0);
+    }
+    calibration.pin_write_ns = (unsigned int) ktime_to_ns(ktime_sub(ktime_get(), start)) / CALIBRATION_PIN_ACCESSES;
+  }
+  local_irq_restore(flags);
+
+  // Lateness of the timers.
+  calibration.max_lateness_ns = 0;
+  memset(calibration.lateness, 0, sizeof(calibration.lateness));
+  calibration_expiries = CALIBRATION_EXPIRIES;
+  hrtimer_start(&timer_calibration, ktime_set(0, CALIBRATION_PERIOD_NS), HRTIMER_MODE_REL);
+  wait_event(calibration_wait, calibration_expiries == 0);
+  hrtimer_cancel(&timer_calibration);
+  release_pins();
+  mutex_unlock(&current_tty_mutex);
+
+  // Budgets, as fractions of the bit period. NRZ samples in the middle of the
+  // bits, and leaves the other half of the margin to the clock mismatch of the
+  // two ends. Manchester tells the edges apart at a quarter of the bit, and
+  // IrDA pulses (3/16 of the bit) must keep at least half their width. In
+  // synchronous master mode, the clock edges must stay within their half bits.
+  error_ns = calibration.max_lateness_ns + max(calibration.pin_read_ns, calibration.pin_write_ns);
+  calibration.max_baudrate_nrz = get_safe_baudrate(error_ns, 1, 4);
+  calibration.max_baudrate_irda = get_safe_baudrate(error_ns, 3, 32);
+  calibration.max_baudrate_manchester = get_safe_baudrate(error_ns, 1, 8);
+  calibration.max_baudrate_sync_master = get_safe_baudrate(error_ns, 1, 4);
+  printk(KERN_INFO "soft_uart: Calibrated: lateness %u ns, pin access %u/%u ns, max baudrate %d (nrz).\n",
+    calibration.max_lateness_ns, calibration.pin_read_ns, calibration.pin_write_ns, calibration.max_baudrate_nrz);
+  return 1;
+}
+
+/**
+ * Gets the results of the last calibration.
+ * @param _calibration where the results are copied to
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_get_calibration(struct raspberry_soft_uart_calibration* _calibration)
+{
+  *_calibration = calibration;
+  return 1;
+}
+
+/**
+ * Gets the fastest baudrate of the current engine, as calibrated. The
+ * synchronous slave follows the clock of its peer, so it has none.
+ * @return The baudrate. 0 if it is not known.
+ */
+int raspberry_soft_uart_get_max_baudrate(void)
+{
+  switch (sync_mode & SOFT_UART_SYNC_MODE)
+  {
+    case SOFT_UART_SYNC_MASTER:
+      return calibration.max_baudrate_sync_master;
+    case SOFT_UART_SYNC_SLAVE:
+      return 0;
+  }
+  switch (line_coding)
+  {
+    case SOFT_UART_CODING_IRDA:
+      return calibration.max_baudrate_irda;
+    case SOFT_UART_CODING_MANCHESTER:
+      return calibration.max_baudrate_manchester;
+    default:
+      return calibration.max_baudrate_nrz;
+  }
+}
+
+/**
+ * Starts receiving on behalf of the raw device.
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_open_raw(void)
+{
+  int success;
+  mutex_lock(&current_tty_mutex);
+  success = add_rx_user();
+  mutex_unlock(&current_tty_mutex);
+  return success;
+}
+
+/**
+ * Stops receiving on behalf of the raw device.
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_close_raw(void)
+{
+  mutex_lock(&current_tty_mutex);
+  remove_rx_user();
   mutex_unlock(&current_tty_mutex);
   return 1;
 }
 
 /**
  * Sets the Soft UART baudrate.
- * @param baudrate desired baudrate
+ * @param baudrate desired baudrate, up to RASPBERRY_SOFT_UART_MAX_BAUDRATE
  * @return 1 if the operation is successful. 0 otherwise.
  */
 int raspberry_soft_uart_set_baudrate(const int baudrate) 
 {
+  if (baudrate <= 0 || baudrate > RASPBERRY_SOFT_UART_MAX_BAUDRATE)
+  {
+    return 0;
+  }
+
+  current_baudrate = baudrate;
   period = ktime_set(0, 1000000000/baudrate);
   half_period = ktime_set(0, 1000000000/baudrate/2);
-  gpio_set_debounce(gpio_rx, 1000/baudrate/2);
+  pulse_width = ktime_set(0, 3 * (1000000000/baudrate) / 16);
+  apply_glitch_filter();
   return 1;
 }
 
-static void recalc_indices(void)
+/**
+ * Sets the width of the RX glitch filter: pulses shorter than that are not
+ * taken as start bits (or, in Manchester, as edges). Where the GPIO controller
+ * supports it, the hardware debounce is set to the same width.
+ * @param _glitch_ns width in nanoseconds, or 0 for 1/8 of the bit period
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_glitch_filter(int _glitch_ns)
 {
-  if (parity_en)
-  {
-    parity_index = 8;
-    final_stop_bit_index = parity_index + stop_bits;
-  }
-  else
+  if (_glitch_ns < 0)
   {
-    parity_index = -1;
-    final_stop_bit_index = 7 + stop_bits;
+    return 0;
   }
+  glitch_ns = _glitch_ns;
+  apply_glitch_filter();
+  return 1;
+}
+
+/**
+ * Applies the character format. It may change in the middle of a character:
+ * the state machines then end the character at the new final stop bit at the
+ * latest, so a change never leaves them waiting for a bit that does not come.
+ */
+static void recalc_indices(void)
+{
+  struct soft_uart_core_frame format;
+
+  soft_uart_core_set_frame(&format, stop_bits, parity_en, parity_odd, ignore_parity_errors);
+  spin_lock_irq(&queue_tx_lock);
+  char_format = format;
+  spin_unlock_irq(&queue_tx_lock);
 }
 
 
@@ -161,6 +589,10 @@ static void recalc_indices(void)
  */
 int raspberry_soft_uart_set_stop_bits(int _stop_bits)
 {
+  if (_stop_bits < 1 || _stop_bits > 2)
+  {
+    return 0;
+  }
   stop_bits = _stop_bits;
   recalc_indices();
   return 1;
@@ -173,17 +605,10 @@ int raspberry_soft_uart_set_stop_bits(int _stop_bits)
  * @param _ignore_parity_errors 1 to receive characters with wrong parity bit, 0 to drop them.
  * @return 1 if the operation is successful. 0 otherwise.
  */
-int raspberry_soft_uart_set_parity(int _parity_en, int parity_odd, int _ignore_parity_errors)
+int raspberry_soft_uart_set_parity(int _parity_en, int _parity_odd, int _ignore_parity_errors)
 {
   parity_en = _parity_en;
-  if (parity_odd)
-  {
-    parity_init = 1;
-  }
-  else
-  {
-    parity_init = 0;
-  }
+  parity_odd = _parity_odd;
   ignore_parity_errors = _ignore_parity_errors;
 
   recalc_indices();
@@ -198,206 +623,896 @@ int raspberry_soft_uart_set_parity(int _parity_en, int parity_odd, int _ignore_p
  */
 int raspberry_soft_uart_send_string(const unsigned char* string, int string_size)
 {
-  int result = enqueue_string(&queue_tx, string, string_size);
-  
-  // Starts the TX timer if it is not already running.
-  if (!hrtimer_active(&timer_tx))
-  {
-    hrtimer_start(&timer_tx, period, HRTIMER_MODE_REL);
-  }
-  
-  return result;
-}
-
-/*
- * Gets the number of characters that can be added to the TX queue.
- * @return number of characters.
- */
-int raspberry_soft_uart_get_tx_queue_room(void)
-{
-  return get_queue_room(&queue_tx);
-}
-
-/*
- * Gets the number of characters in the TX queue.
- * @return number of characters.
- */
-int raspberry_soft_uart_get_tx_queue_size(void)
-{
-  return get_queue_size(&queue_tx);
+  return enqueue_tx(string, string_size, tx_priority, false);
 }
 
 /**
- * Sets the callback function to be called on received character.
- * @param callback the callback function
+ * Encodes a given payload into a frame, according to the framing mode, and
+ * adds the whole frame to the TX queue.
+ * @param data given payload
+ * @param size size of the given payload
+ * @return size if the frame is queued. 0 if there is no room for it yet.
+ * -1 if it can never fit in the TX queue.
  */
-int raspberry_soft_uart_set_rx_callback(void (*callback)(unsigned char))
+int raspberry_soft_uart_send_frame(const unsigned char* data, int size)
 {
-	rx_callback = callback;
-	return 1;
-}
-
-//-----------------------------------------------------------------------------
-// Internals
-//-----------------------------------------------------------------------------
+  unsigned char frame[QUEUE_MAX_SIZE];
+  int frame_size = framing_encode(framing_mode, data, size, frame, sizeof(frame));
 
-/**
- * If we are waiting for the RX start bit, then starts the RX timer. Otherwise,
- * does nothing.
- */
-static irq_handler_t handle_rx_start(unsigned int irq, void* device, struct pt_regs* registers)
-{
-  if (rx_bit_index == -1)
+  if (frame_size < 0)
   {
-    hrtimer_start(&timer_rx, half_period, HRTIMER_MODE_REL);
+    return -1;
   }
-  return (irq_handler_t) IRQ_HANDLED;
+  return enqueue_tx(frame, frame_size, tx_priority, true) == frame_size ? size : 0;
 }
 
-
 /**
- * Dequeues a character from the TX queue and sends it.
+ * Sends a given packet and waits until it is completely on the wire. The packet
+ * is added to the TX queue as a whole, so it is never interleaved with other
+ * writes; in a framing mode, it is sent as one frame.
+ * @param data given packet
+ * @param size size of the given packet
+ * @param priority SOFT_UART_TX_PRIORITY_* priority
+ * @param first_start time at which the first start bit was driven
+ * @param last_stop time at which the last stop bit was driven
+ * @return 0 if the packet is sent. -EAGAIN if there is no room for it yet.
+ * -EMSGSIZE if it can never fit in the TX queue. Another error code otherwise.
  */
-static enum hrtimer_restart handle_tx(struct hrtimer* timer)
+int raspberry_soft_uart_send_packet(const unsigned char* data, int size, int priority, ktime_t* first_start, ktime_t* last_stop)
 {
-  ktime_t current_time = ktime_get();
-  static unsigned char character = 0;
-  static int bit_index = -1;
-  enum hrtimer_restart result = HRTIMER_NORESTART;
-  bool must_restart_timer = false;
-  static int parity = 0;
-  
-  // Start bit.
-  if (bit_index == -1)
+  unsigned char frame[QUEUE_MAX_SIZE];
+  struct queue* queue;
+  int error = 0;
+
+  if (gpio_tx < 0)
   {
-    if (dequeue_character(&queue_tx, &character))
-    {
-      gpio_set_value(gpio_tx, 0);
-      bit_index++;
-      parity = parity_init;
-      must_restart_timer = true;
-    }
+    return -EIO;
   }
-  
-  // Data bits.
-  else if (0 <= bit_index && bit_index < 8)
+  if (size <= 0 || priority < 0 || priority >= SOFT_UART_TX_PRIORITIES)
   {
-    int bit_value = 1 & (character >> bit_index);
-    gpio_set_value(gpio_tx, bit_value);
-    parity ^= bit_value;
-    bit_index++;
-    must_restart_timer = true;
+    return -EINVAL;
   }
 
-  // Parity bit (optional)
-  else if (bit_index == parity_index)
+  if (framing_mode != SOFT_UART_FRAMING_NONE)
   {
-    gpio_set_value(gpio_tx, parity);
-    bit_index++;
-    must_restart_timer = true;
+    size = framing_encode(framing_mode, data, size, frame, sizeof(frame));
+    data = frame;
   }
-  
-  // Stop bit(s).
-  else if (bit_index <= final_stop_bit_index)
+  if (size < 0 || size > QUEUE_MAX_SIZE)
   {
-    gpio_set_value(gpio_tx, 1);
-    if (bit_index == final_stop_bit_index)
-    {
-      character = 0;
-      bit_index = -1;
-      parity = 0;
-      must_restart_timer = get_queue_size(&queue_tx) > 0;
-    }
-    else
-    {
-      bit_index++;
-      must_restart_timer = true;
-    }
+    return -EMSGSIZE;
   }
-  
-  // Restarts the TX timer.
-  if (must_restart_timer)
+
+  if (mutex_lock_interruptible(&tx_packet_mutex))
   {
-    hrtimer_forward(&timer_tx, current_time, period);
-    result = HRTIMER_RESTART;
+    return -ERESTARTSYS;
   }
-  
-  return result;
-}
 
-/*
- * Receives a character and sends it to the kernel.
- */
-static enum hrtimer_restart handle_rx(struct hrtimer* timer)
-{
-  ktime_t current_time = ktime_get();
-  static unsigned int character = 0;
-  static int parity = 0;
-  static bool parity_ok = true;
-  int bit_value = gpio_get_value(gpio_rx);
-  enum hrtimer_restart result = HRTIMER_NORESTART;
-  bool must_restart_timer = false;
-  
-  // Start bit.
-  if (rx_bit_index == -1)
+  queue = &queue_tx[priority];
+  spin_lock_irq(&queue_tx_lock);
+  if (get_queue_room(queue) < size)
   {
-    rx_bit_index++;
-    character = 0;
-    parity = parity_init;
-    parity_ok = true;
-    must_restart_timer = true;
+    error = -EAGAIN;
   }
-  
-  // Data bits.
-  else if (0 <= rx_bit_index && rx_bit_index < 8)
+  else
   {
-    if (bit_value == 0)
+    tx_packet.pending   = true;
+    tx_packet.started   = false;
+    tx_packet.sent_last = false;
+    tx_packet.done      = false;
+    tx_packet.aborted   = false;
+    tx_packet.priority  = priority;
+    tx_packet.first     = tx_dequeued[priority] + get_queue_size(queue);
+    tx_packet.last      = tx_packet.first + size - 1;
+    enqueue_string(queue, data, size);
+    if (!hrtimer_active(&timer_tx) && (sync_mode & SOFT_UART_SYNC_MODE) != SOFT_UART_SYNC_SLAVE)
     {
-      character &= 0xfeff;
+      hrtimer_start(&timer_tx, period, HRTIMER_MODE_REL);
     }
-    else
-    {
-      character |= 0x0100;
-    }
-    parity ^= bit_value;
-    
-    rx_bit_index++;
-    character >>= 1;
-    must_restart_timer = true;
   }
+  spin_unlock_irq(&queue_tx_lock);
 
-  // Parity bit (optional)
-  else if (rx_bit_index == parity_index)
+  if (error == 0)
   {
-    if (bit_value != parity)
+    error = wait_event_interruptible(tx_packet_wait, tx_packet.done);
+
+    // The packet is queued already, so the call must not be restarted.
+    if (error == -ERESTARTSYS)
     {
-      parity_ok = false;
+      error = -EINTR;
     }
-    rx_bit_index++;
-    must_restart_timer = true;
-  }
 
-  // Extra stop bit (optional)
-  else if (rx_bit_index < final_stop_bit_index)
-  {
-    rx_bit_index++;
-    must_restart_timer = true;
-  }
-  
-  // Final stop bit.
-  else if (rx_bit_index == final_stop_bit_index)
-  {
-    if (parity_ok || ignore_parity_errors)
+    spin_lock_irq(&queue_tx_lock);
+    if (error == 0 && tx_packet.aborted)
     {
-      receive_character(character);
+      error = -EIO;
     }
-    rx_bit_index = -1;
+    *first_start = tx_packet.first_start;
+    *last_stop = tx_packet.last_stop;
+    tx_packet.pending = false;
+    spin_unlock_irq(&queue_tx_lock);
   }
-  
-  // Restarts the RX timer.
-  if (must_restart_timer)
-  {
-    hrtimer_forward(&timer_rx, current_time, period);
+
+  mutex_unlock(&tx_packet_mutex);
+  return error;
+}
+
+/**
+ * Discards everything queued for TX. The character on the wire (if any) is
+ * completed, so the line is left in a clean state and the flush takes effect
+ * within one character time. A packet whose last character has not been sent
+ * yet is aborted.
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_flush_tx(void)
+{
+  unsigned long flags;
+  int i;
+
+  spin_lock_irqsave(&queue_tx_lock, flags);
+  for (i = 0; i < SOFT_UART_TX_PRIORITIES; i++)
+  {
+    initialize_queue(&queue_tx[i]);
+  }
+  tx_locked_priority = -1;
+  if (tx_packet.pending && !tx_packet.done && !tx_packet.sent_last)
+  {
+    tx_packet.done = true;
+    tx_packet.aborted = true;
+  }
+  spin_unlock_irqrestore(&queue_tx_lock, flags);
+
+  wake_up_interruptible(&tx_packet_wait);
+  return 1;
+}
+
+/**
+ * Sets the framing mode. In a framing mode other than SOFT_UART_FRAMING_NONE,
+ * only whole frames with a good CRC are delivered to the TTY (without the
+ * delimiters, escaping and CRC), and every write is sent as one frame.
+ * @param mode SOFT_UART_FRAMING_* mode
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_framing(int mode)
+{
+  if (mode != SOFT_UART_FRAMING_NONE && framing_get_delimiter(mode) < 0)
+  {
+    return 0;
+  }
+  spin_lock_irq(&rx_buffer_lock);
+  framing_mode = mode;
+  framing_reset(&rx_framing, mode);
+  spin_unlock_irq(&rx_buffer_lock);
+  spin_lock_irq(&queue_tx_lock);
+  tx_locked_priority = -1;
+  spin_unlock_irq(&queue_tx_lock);
+  return 1;
+}
+
+/**
+ * Selects the TX queue that the following writes go to. The TX engine always
+ * sends the next character from the highest priority queue that is not empty,
+ * but it never interrupts a frame (in a framing mode) that is in progress.
+ * @param priority SOFT_UART_TX_PRIORITY_* priority
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_tx_priority(int priority)
+{
+  if (priority < 0 || priority >= SOFT_UART_TX_PRIORITIES)
+  {
+    return 0;
+  }
+  tx_priority = priority;
+  return 1;
+}
+
+/**
+ * Selects the asynchronous mode or a synchronous (clocked) mode. The character
+ * format (start, data, parity and stop bits) is the same in all modes; in the
+ * synchronous modes, one bit is shifted per clock cycle instead of per period.
+ * As a master, the port drives the clock at the baudrate while it transmits,
+ * and samples RX on the same clock. As a slave, it follows the peer's clock.
+ * A character in progress is cut short, and so is the packet being sent, if
+ * any.
+ * @param mode SOFT_UART_SYNC_* mode, with the SOFT_UART_SYNC_CPOL and
+ * SOFT_UART_SYNC_CPHA flags
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_sync(int mode)
+{
+  int clock_mode = mode & SOFT_UART_SYNC_MODE;
+  int idle_clock = (mode & SOFT_UART_SYNC_CPOL) ? 1 : 0;
+
+  if ((mode & ~(SOFT_UART_SYNC_MODE | SOFT_UART_SYNC_CPOL | SOFT_UART_SYNC_CPHA)) != 0
+    || clock_mode > SOFT_UART_SYNC_SLAVE
+    || (clock_mode != SOFT_UART_SYNC_OFF && (gpio_clk < 0 || line_coding != SOFT_UART_CODING_NRZ)))
+  {
+    return 0;
+  }
+
+  mutex_lock(&current_tty_mutex);
+  hrtimer_cancel(&timer_tx);
+  hrtimer_cancel(&timer_rx);
+  if ((sync_mode & SOFT_UART_SYNC_MODE) == SOFT_UART_SYNC_SLAVE)
+  {
+    disable_irq(gpio_to_irq(gpio_clk));
+  }
+
+  spin_lock_irq(&queue_tx_lock);
+  sync_mode = mode;
+  sync_sample_phase = false;
+  tx.bit_index = -1;
+  abort_tx_packet();
+  rx.bit_index = -1;
+  rx_confirming_start = false;
+  rx_hunting = false;
+  spin_unlock_irq(&queue_tx_lock);
+  wake_up_interruptible(&tx_packet_wait);
+
+  if (pins_acquired && gpio_tx >= 0)
+  {
+    gpiod_set_raw_value(gpio_tx_desc, 1);
+  }
+  if (clock_mode == SOFT_UART_SYNC_MASTER)
+  {
+    gpio_direction_output(gpio_clk, idle_clock);
+  }
+  else if (gpio_clk >= 0)
+  {
+    gpio_direction_input(gpio_clk);
+  }
+
+  if (clock_mode == SOFT_UART_SYNC_SLAVE)
+  {
+    enable_irq(gpio_to_irq(gpio_clk));
+  }
+  else if (pins_acquired && raspberry_soft_uart_get_tx_queue_size() > 0)
+  {
+    // Resumes sending what is still queued.
+    hrtimer_start(&timer_tx, period, HRTIMER_MODE_REL);
+  }
+  mutex_unlock(&current_tty_mutex);
+  return 1;
+}
+
+/**
+ * Selects the line coding of the asynchronous mode. In SOFT_UART_CODING_IRDA,
+ * the line follows IrDA SIR: TX idles low and every 0 bit is a high pulse of
+ * 3/16 of the bit period; RX idles high and every 0 bit is a short low pulse.
+ * RX bits are then recovered from the timestamps of the pulses, as the pulses
+ * are much too short to be sampled. In SOFT_UART_CODING_MANCHESTER, every bit
+ * has a transition in its middle (high to low for 0, low to high for 1), and
+ * the line idles low. RX recovers the clock from those transitions, so the
+ * length of a transmission is not limited by the mismatch of the baudrates.
+ * A character in progress is cut short, and so is the packet being sent, if
+ * any.
+ * @param coding SOFT_UART_CODING_* line coding
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int raspberry_soft_uart_set_coding(int coding)
+{
+  if (coding < SOFT_UART_CODING_NRZ || coding > SOFT_UART_CODING_MANCHESTER
+    || (coding != SOFT_UART_CODING_NRZ && (sync_mode & SOFT_UART_SYNC_MODE) != SOFT_UART_SYNC_OFF))
+  {
+    return 0;
+  }
+
+  mutex_lock(&current_tty_mutex);
+  hrtimer_cancel(&timer_tx);
+  hrtimer_cancel(&timer_rx);
+
+  spin_lock_irq(&queue_tx_lock);
+  line_coding = coding;
+  tx.bit_index = -1;
+  tx_pulse_on = false;
+  tx_second_half = false;
+  abort_tx_packet();
+  rx.bit_index = -1;
+  rx_frame_active = false;
+  rx_confirming_start = false;
+  rx_hunting = false;
+  rx_frame_errors_in_row = 0;
+  spin_unlock_irq(&queue_tx_lock);
+  wake_up_interruptible(&tx_packet_wait);
+
+  if (pins_acquired && gpio_tx >= 0)
+  {
+    gpiod_set_raw_value(gpio_tx_desc, (coding == SOFT_UART_CODING_NRZ) ? 1 : 0);
+  }
+  apply_glitch_filter();
+
+  // Manchester needs the rising edges too.
+  if (pins_acquired)
+  {
+    irq_set_irq_type(
+      gpio_to_irq(gpio_rx),
+      (coding == SOFT_UART_CODING_MANCHESTER) ? IRQ_TYPE_EDGE_BOTH : IRQ_TYPE_EDGE_FALLING);
+  }
+
+  // Resumes sending what is still queued.
+  if (pins_acquired && raspberry_soft_uart_get_tx_queue_size() > 0)
+  {
+    hrtimer_start(&timer_tx, period, HRTIMER_MODE_REL);
+  }
+  mutex_unlock(&current_tty_mutex);
+  return 1;
+}
+
+/**
+ * Gets the baudrate.
+ * @return baudrate, or 0 if not set yet.
+ */
+int raspberry_soft_uart_get_baudrate(void)
+{
+  return current_baudrate;
+}
+
+/**
+ * Gets the name of the engine currently driving the line.
+ * @return name of the engine
+ */
+const char* raspberry_soft_uart_get_engine_name(void)
+{
+  switch (sync_mode & SOFT_UART_SYNC_MODE)
+  {
+    case SOFT_UART_SYNC_MASTER:
+      return "sync-master";
+    case SOFT_UART_SYNC_SLAVE:
+      return "sync-slave";
+  }
+  switch (line_coding)
+  {
+    case SOFT_UART_CODING_IRDA:
+      return "irda";
+    case SOFT_UART_CODING_MANCHESTER:
+      return "manchester";
+    default:
+      return "nrz";
+  }
+}
+
+/**
+ * Gets the interruption of the RX pin.
+ * @return interruption number, or 0 while the pins are not acquired.
+ */
+int raspberry_soft_uart_get_rx_irq(void)
+{
+  return pins_acquired ? gpio_to_irq(gpio_rx) : 0;
+}
+
+/**
+ * Gets the framing mode.
+ * @return SOFT_UART_FRAMING_* mode
+ */
+int raspberry_soft_uart_get_framing(void)
+{
+  return framing_mode;
+}
+
+/**
+ * Tells whether the Soft UART is RX-only (it has no TX pin).
+ * @return 1 if RX-only. 0 otherwise.
+ */
+int raspberry_soft_uart_is_rx_only(void)
+{
+  return gpio_tx < 0;
+}
+
+/*
+ * Gets the number of characters that can be added to the selected TX queue.
+ * @return number of characters.
+ */
+int raspberry_soft_uart_get_tx_queue_room(void)
+{
+  unsigned long flags;
+  int room;
+  spin_lock_irqsave(&queue_tx_lock, flags);
+  room = get_queue_room(&queue_tx[tx_priority]);
+  spin_unlock_irqrestore(&queue_tx_lock, flags);
+  return room;
+}
+
+/*
+ * Gets the number of characters in all TX queues.
+ * @return number of characters.
+ */
+int raspberry_soft_uart_get_tx_queue_size(void)
+{
+  unsigned long flags;
+  int size;
+  spin_lock_irqsave(&queue_tx_lock, flags);
+  size = get_tx_size();
+  spin_unlock_irqrestore(&queue_tx_lock, flags);
+  return size;
+}
+
+/**
+ * Sets the callback function to be called on received character.
+ * @param callback the callback function
+ */
+int raspberry_soft_uart_set_rx_callback(void (*callback)(unsigned char))
+{
+	rx_callback = callback;
+	return 1;
+}
+
+//-----------------------------------------------------------------------------
+// Internals
+//-----------------------------------------------------------------------------
+
+/**
+ * Requests the TX and RX pins and the RX interruption, which is left disabled.
+ * The TX pin is left idle for the current line coding. On failure, whatever
+ * was acquired is released.
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+static int acquire_pins(void)
+{
+  bool tx_ok = gpio_tx < 0 || gpio_request(gpio_tx, "soft_uart_tx") == 0;
+  bool rx_ok = gpio_request(gpio_rx, "soft_uart_rx") == 0;
+  bool irq_ok = false;
+  unsigned long flags = (line_coding == SOFT_UART_CODING_MANCHESTER) ? IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING : IRQF_TRIGGER_FALLING;
+
+  // The RX interruption must not fire before the descriptors are set up.
+  if (rx_ok)
+  {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+    flags |= IRQF_NO_AUTOEN;
+#else
+    irq_set_status_flags(gpio_to_irq(gpio_rx), IRQ_NOAUTOEN);
+#endif
+    irq_ok = request_irq(gpio_to_irq(gpio_rx), (irq_handler_t) handle_rx_start, flags, "soft_uart_irq_handler", NULL) == 0;
+  }
+
+  if (!tx_ok || !rx_ok || !irq_ok)
+  {
+    if (irq_ok)
+    {
+      free_irq(gpio_to_irq(gpio_rx), NULL);
+    }
+    if (rx_ok)
+    {
+      gpio_free(gpio_rx);
+    }
+    if (tx_ok && gpio_tx >= 0)
+    {
+      gpio_free(gpio_tx);
+    }
+    return 0;
+  }
+
+  gpio_tx_desc = (gpio_tx >= 0) ? gpio_to_desc(gpio_tx) : NULL;
+  gpio_rx_desc = gpio_to_desc(gpio_rx);
+  if (gpio_tx >= 0)
+  {
+    gpio_direction_output(gpio_tx, (line_coding == SOFT_UART_CODING_NRZ) ? 1 : 0);
+  }
+  gpio_direction_input(gpio_rx);
+  pins_acquired = true;
+  apply_glitch_filter();
+  return 1;
+}
+
+/**
+ * Releases the TX and RX pins and the RX interruption. The TX pin is left at
+ * the idle level of the current line coding, so a closed port does not hold
+ * the line in a break.
+ */
+static void release_pins(void)
+{
+  free_irq(gpio_to_irq(gpio_rx), NULL);
+  if (gpio_tx >= 0)
+  {
+    gpiod_set_raw_value(gpio_tx_desc, (line_coding == SOFT_UART_CODING_NRZ) ? 1 : 0);
+    gpio_free(gpio_tx);
+  }
+  gpio_free(gpio_rx);
+  gpio_tx_desc = NULL;
+  gpio_rx_desc = NULL;
+  pins_acquired = false;
+}
+
+/**
+ * Acquires the pins and enables the RX interruption when the first user (TTY
+ * or raw device) arrives.
+ * Must be called with current_tty_mutex held.
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+static int add_rx_user(void)
+{
+  if (rx_users == 0)
+  {
+    if (!acquire_pins())
+    {
+      printk(KERN_ALERT "soft_uart: Failed to acquire GPIO %d (TX) and %d (RX).\n", gpio_tx, gpio_rx);
+      return 0;
+    }
+    rx.bit_index = -1;
+    rx_confirming_start = false;
+    rx_hunting = false;
+    rx_frame_errors_in_row = 0;
+    enable_irq(gpio_to_irq(gpio_rx));
+  }
+  rx_users++;
+  return 1;
+}
+
+/**
+ * Disables the RX interruption and releases the pins when the last user
+ * leaves. Whatever is still queued for TX is not sent.
+ * Must be called with current_tty_mutex held.
+ */
+static void remove_rx_user(void)
+{
+  if (--rx_users == 0)
+  {
+    disable_irq(gpio_to_irq(gpio_rx));
+    hrtimer_cancel(&timer_rx);
+    hrtimer_cancel(&timer_tx);
+    release_pins();
+  }
+}
+
+/**
+ * Applies the glitch filter width for the current baudrate and line coding
+ * (see soft_uart_core_glitch_width()). IrDA pulses are shorter than any useful
+ * filter, so the filter is off in that coding.
+ */
+static void apply_glitch_filter(void)
+{
+  s64 width = soft_uart_core_glitch_width(glitch_ns, ktime_to_ns(period));
+  u32 debounce_us;
+
+  if (line_coding == SOFT_UART_CODING_IRDA)
+  {
+    width = 0;
+  }
+  rx_glitch = ns_to_ktime(width);
+
+  // The hardware debounce (in microseconds) would delay the Manchester edges.
+  // Where it is applied, the RX interruption comes that much after the edge.
+  rx_debounce = ns_to_ktime(0);
+  if (pins_acquired)
+  {
+    debounce_us = (line_coding == SOFT_UART_CODING_NRZ) ? (u32) width / 1000 : 0;
+    if (gpio_set_debounce(gpio_rx, debounce_us) == 0)
+    {
+      rx_debounce = ns_to_ktime((s64) debounce_us * NSEC_PER_USEC);
+    }
+  }
+}
+
+/**
+ * Adds a given string to the TX queue and starts the TX timer if it is not
+ * already running. May be called from interrupt context.
+ * @param string given string
+ * @param string_size size of the given string
+ * @param priority SOFT_UART_TX_PRIORITY_* priority of the queue
+ * @param all_or_nothing true to add nothing unless the whole string fits
+ * @return The amount of characters successfully added to the queue.
+ */
+static int enqueue_tx(const unsigned char* string, int string_size, int priority, bool all_or_nothing)
+{
+  unsigned long flags;
+  int result = 0;
+  struct queue* queue = &queue_tx[priority];
+
+  if (gpio_tx < 0)
+  {
+    return 0;
+  }
+
+  spin_lock_irqsave(&queue_tx_lock, flags);
+  if (!all_or_nothing || get_queue_room(queue) >= string_size)
+  {
+    result = enqueue_string(queue, string, string_size);
+  }
+  
+  // Starts the TX timer if it is not already running. In synchronous slave
+  // mode, the peer's clock paces the TX instead.
+  if (!hrtimer_active(&timer_tx) && (sync_mode & SOFT_UART_SYNC_MODE) != SOFT_UART_SYNC_SLAVE)
+  {
+    hrtimer_start(&timer_tx, period, HRTIMER_MODE_REL);
+  }
+  spin_unlock_irqrestore(&queue_tx_lock, flags);
+  
+  return result;
+}
+
+/**
+ * Gets the next character to send, from the highest priority TX queue that is
+ * not empty. In a framing mode, keeps taking from the same queue until the
+ * frame in progress ends with a delimiter, so frames are never interleaved.
+ * Must be called with queue_tx_lock held.
+ * @param character where the character is written to
+ * @return 1 if a character is fetched. 0 if all queues are empty.
+ */
+static int dequeue_tx(unsigned char* character)
+{
+  int priority = tx_locked_priority;
+  int delimiter = framing_get_delimiter(framing_mode);
+  unsigned int sequence;
+
+  // A packet in progress is never interrupted either.
+  if (tx_packet.pending && tx_packet.started && !tx_packet.sent_last)
+  {
+    priority = tx_packet.priority;
+  }
+
+  if (priority < 0 || get_queue_size(&queue_tx[priority]) == 0)
+  {
+    priority = SOFT_UART_TX_PRIORITIES - 1;
+    while (priority > 0 && get_queue_size(&queue_tx[priority]) == 0)
+    {
+      priority--;
+    }
+  }
+
+  if (!dequeue_character(&queue_tx[priority], character))
+  {
+    return 0;
+  }
+
+  if (delimiter >= 0)
+  {
+    tx_locked_priority = (*character == delimiter) ? -1 : priority;
+  }
+
+  // Wakes up the writers when half of their queue is free, and when it empties.
+  if (priority == tx_priority
+    && (get_queue_room(&queue_tx[priority]) == QUEUE_MAX_SIZE / 2 || get_queue_size(&queue_tx[priority]) == 0))
+  {
+    schedule_work(&tx_wakeup_work);
+  }
+
+  // Tells whether the character begins or ends the packet being sent.
+  sequence = tx_dequeued[priority]++;
+  tx_character_is_first = false;
+  tx_character_is_last = false;
+  if (tx_packet.pending && priority == tx_packet.priority)
+  {
+    if (sequence == tx_packet.first)
+    {
+      tx_packet.started = true;
+      tx_character_is_first = true;
+    }
+    if (sequence == tx_packet.last)
+    {
+      tx_packet.sent_last = true;
+      tx_character_is_last = true;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Gets the number of characters in all TX queues.
+ * Must be called with queue_tx_lock held.
+ * @return number of characters.
+ */
+static int get_tx_size(void)
+{
+  int size = 0;
+  int i;
+
+  for (i = 0; i < SOFT_UART_TX_PRIORITIES; i++)
+  {
+    size += get_queue_size(&queue_tx[i]);
+  }
+  return size;
+}
+
+/**
+ * Aborts the packet being sent, if any, when its characters will not all go
+ * out (the port closes, or the character on the wire is cut short). The
+ * caller wakes up tx_packet_wait once it has released the lock.
+ * Must be called with queue_tx_lock held.
+ */
+static void abort_tx_packet(void)
+{
+  if (tx_packet.pending && !tx_packet.done)
+  {
+    tx_packet.done = true;
+    tx_packet.aborted = true;
+  }
+}
+
+/**
+ * If we are waiting for the RX start bit, then starts the RX timer. Otherwise,
+ * does nothing.
+ */
+static irq_handler_t handle_rx_start(unsigned int irq, void* device, struct pt_regs* registers)
+{
+  if ((sync_mode & SOFT_UART_SYNC_MODE) != SOFT_UART_SYNC_OFF)
+  {
+    return (irq_handler_t) IRQ_HANDLED;
+  }
+
+  // IrDA: every falling edge is the pulse of a 0 bit.
+  if (line_coding == SOFT_UART_CODING_IRDA)
+  {
+    handle_irda_pulse(ktime_get());
+  }
+
+  // Manchester: the edges carry both the data and the clock.
+  else if (line_coding == SOFT_UART_CODING_MANCHESTER)
+  {
+    handle_manchester_edge(ktime_get(), gpiod_get_raw_value(gpio_rx_desc));
+  }
+  // NRZ: checks that the line is still low once the glitch width has elapsed,
+  // then samples the middle of every bit. The edge was rx_debounce earlier.
+  else if (rx.bit_index == -1 && !rx_confirming_start && !rx_hunting)
+  {
+    rx_start_time = ktime_sub(ktime_get(), rx_debounce);
+    if (ktime_to_ns(rx_glitch) > 0)
+    {
+      rx_confirming_start = true;
+      hrtimer_start(&timer_rx, rx_glitch, HRTIMER_MODE_REL);
+    }
+    else
+    {
+      hrtimer_start(&timer_rx, ktime_sub(half_period, rx_debounce), HRTIMER_MODE_REL);
+    }
+  }
+  return (irq_handler_t) IRQ_HANDLED;
+}
+
+/**
+ * In synchronous slave mode, shifts the TX data out on the launch edges of the
+ * peer's clock, and samples the RX data on the other edges.
+ */
+static irq_handler_t handle_clock(unsigned int irq, void* device, struct pt_regs* registers)
+{
+  ktime_t current_time = ktime_get();
+  int level;
+
+  if ((sync_mode & SOFT_UART_SYNC_MODE) != SOFT_UART_SYNC_SLAVE || !pins_acquired)
+  {
+    return (irq_handler_t) IRQ_HANDLED;
+  }
+
+  if (is_launch_edge(gpiod_get_raw_value(gpio_clk_desc)))
+  {
+    if (gpio_tx >= 0)
+    {
+      spin_lock(&queue_tx_lock);
+      level = tx_next_bit(current_time);
+      spin_unlock(&queue_tx_lock);
+      gpiod_set_raw_value(gpio_tx_desc, (level < 0) ? 1 : level);
+    }
+  }
+  else
+  {
+    sample_sync_rx(current_time);
+  }
+  return (irq_handler_t) IRQ_HANDLED;
+}
+
+/**
+ * Dequeues a character from the TX queue and sends it.
+ */
+static enum hrtimer_restart handle_tx(struct hrtimer* timer)
+{
+  ktime_t current_time = ktime_get();
+  enum hrtimer_restart result = HRTIMER_NORESTART;
+  bool must_restart_timer = false;
+  bool must_sample = false;
+  ktime_t interval = period;
+  int level;
+
+  if (static_branch_unlikely(&instrumentation))
+  {
+    record_lateness(timer, current_time, &counters.max_lateness_ns, counters.lateness);
+  }
+  
+  spin_lock(&queue_tx_lock);
+
+  // Synchronous master: one clock edge every half period.
+  if ((sync_mode & SOFT_UART_SYNC_MODE) == SOFT_UART_SYNC_MASTER)
+  {
+    must_restart_timer = handle_sync_master(current_time, &must_sample);
+    interval = half_period;
+  }
+
+  // IrDA: one bit every period, 0 bits being short pulses.
+  else if (line_coding == SOFT_UART_CODING_IRDA)
+  {
+    must_restart_timer = handle_irda_tx(current_time, &interval);
+  }
+
+  // Manchester: one half bit every half period.
+  else if (line_coding == SOFT_UART_CODING_MANCHESTER)
+  {
+    must_restart_timer = handle_manchester_tx(current_time, &interval);
+  }
+
+  // Asynchronous: one bit every period.
+  else
+  {
+    level = tx_next_bit(current_time);
+    if (level >= 0)
+    {
+      gpiod_set_raw_value(gpio_tx_desc, level);
+    }
+    must_restart_timer = (level >= 0) && (tx.bit_index != -1 || get_tx_size() > 0);
+  }
+  
+  spin_unlock(&queue_tx_lock);
+
+  // Synchronous master: samples RX outside of queue_tx_lock.
+  if (must_sample)
+  {
+    sample_sync_rx(current_time);
+  }
+
+  // Restarts the TX timer.
+  if (must_restart_timer)
+  {
+    hrtimer_forward(&timer_tx, current_time, interval);
+    result = HRTIMER_RESTART;
+  }
+  
+  return result;
+}
+
+/*
+ * Receives a character and sends it to the kernel.
+ */
+static enum hrtimer_restart handle_rx(struct hrtimer* timer)
+{
+  ktime_t current_time = ktime_get();
+  int bit_value = gpiod_get_raw_value(gpio_rx_desc);
+  enum hrtimer_restart result = HRTIMER_NORESTART;
+
+  if (static_branch_unlikely(&instrumentation))
+  {
+    record_lateness(timer, current_time, &counters.max_lateness_ns, counters.lateness);
+  }
+
+  // IrDA: the frame is over, and its pulses have all been seen.
+  if (line_coding == SOFT_UART_CODING_IRDA)
+  {
+    decode_irda_frame();
+  }
+
+  // Hunting: waits for the line to be idle for a whole frame.
+  else if (rx_hunting)
+  {
+    if (hunt_idle(bit_value, current_time))
+    {
+      hrtimer_forward(&timer_rx, current_time, period);
+      result = HRTIMER_RESTART;
+    }
+  }
+
+  // A start bit must still be low after the glitch width, and in its middle.
+  else if (rx.bit_index == -1 && bit_value != 0)
+  {
+    rx_confirming_start = false;
+    counters.glitches++;
+  }
+  else if (rx_confirming_start)
+  {
+    rx_confirming_start = false;
+    hrtimer_forward(&timer_rx, current_time, ktime_sub(ktime_sub(half_period, rx_glitch), rx_debounce));
+    result = HRTIMER_RESTART;
+  }
+  
+  // Restarts the RX timer.
+  else if (rx_next_bit(bit_value))
+  {
+    hrtimer_forward(&timer_rx, current_time, period);
+    result = HRTIMER_RESTART;
+  }
+
+  // Consecutive framing errors: the start bits are probably being taken from
+  // the middle of the characters, so the receiver loses the lock.
+  else if (rx_frame_errors_in_row >= 2)
+  {
+    rx_hunting = true;
+    rx_mark_bits = 0;
+    rx_hunt_start = current_time;
+    hrtimer_forward(&timer_rx, current_time, period);
     result = HRTIMER_RESTART;
   }
   
@@ -405,28 +1520,561 @@ static enum hrtimer_restart handle_rx(struct hrtimer* timer)
 }
 
 /**
- * Adds a given (received) character to the RX buffer, which is managed by the kernel,
- * and then flushes (flip) it.
+ * Runs the calibration timer, which reads the RX pin like the RX timer does.
+ */
+static enum hrtimer_restart handle_calibration(struct hrtimer* timer)
+{
+  ktime_t current_time = ktime_get();
+
+  gpiod_get_raw_value(gpio_rx_desc);
+  record_lateness(timer, current_time, &calibration.max_lateness_ns, calibration.lateness);
+  if (--calibration_expiries > 0)
+  {
+    hrtimer_forward(timer, current_time, ktime_set(0, CALIBRATION_PERIOD_NS));
+    return HRTIMER_RESTART;
+  }
+  wake_up(&calibration_wait);
+  return HRTIMER_NORESTART;
+}
+
+/**
+ * Keeps the worst lateness of the timers, that is, how long after its expiry
+ * time a timer actually ran, and its histogram. It tells how close to its
+ * limits the host is.
+ * @param timer given timer
+ * @param current_time time at which the timer runs
+ * @param max_lateness_ns worst lateness so far
+ * @param histogram RASPBERRY_SOFT_UART_LATENESS_BUCKETS counters
+ */
+static void record_lateness(struct hrtimer* timer, ktime_t current_time, unsigned int* max_lateness_ns, unsigned int* histogram)
+{
+  s64 lateness = ktime_to_ns(ktime_sub(current_time, hrtimer_get_expires(timer)));
+  unsigned int lateness_us;
+  int bucket = 0;
+
+  if (lateness < 0)
+  {
+    lateness = 0;
+  }
+  if (lateness > U32_MAX)
+  {
+    lateness = U32_MAX;
+  }
+  if (lateness > *max_lateness_ns)
+  {
+    *max_lateness_ns = lateness;
+  }
+
+  lateness_us = (unsigned int) lateness / NSEC_PER_USEC;
+  if (lateness_us > 0)
+  {
+    bucket = min_t(int, ilog2(lateness_us) + 1, RASPBERRY_SOFT_UART_LATENESS_BUCKETS - 1);
+  }
+  histogram[bucket]++;
+}
+
+/**
+ * Gets the fastest baudrate at which a given timing error stays within a given
+ * fraction of the bit period.
+ * @param error_ns given timing error
+ * @param budget_num numerator of the fraction
+ * @param budget_den denominator of the fraction
+ * @return The baudrate, up to RASPBERRY_SOFT_UART_MAX_BAUDRATE.
+ */
+static int get_safe_baudrate(unsigned int error_ns, int budget_num, int budget_den)
+{
+  u64 baudrate = div64_u64((u64) NSEC_PER_SEC * budget_num, (u64) max(error_ns, 1u) * budget_den);
+
+  return min_t(u64, baudrate, RASPBERRY_SOFT_UART_MAX_BAUDRATE);
+}
+
+/**
+ * Samples the line while hunting for the next frame. Once it has been idle
+ * (high) for a whole frame, a falling edge can only be a genuine start bit,
+ * so the receiver locks again.
+ * @param bit_value level of the RX line
+ * @param current_time time of the sample
+ * @return true while still hunting.
+ */
+static bool hunt_idle(int bit_value, ktime_t current_time)
+{
+  if (soft_uart_core_hunt_next_bit(&rx_mark_bits, &char_format, bit_value))
+  {
+    return true;
+  }
+
+  rx_hunting = false;
+  rx_frame_errors_in_row = 0;
+  counters.relocks++;
+  counters.last_relock_us = ktime_to_us(ktime_sub(current_time, rx_hunt_start));
+  return false;
+}
+
+/**
+ * Generates one clock edge in synchronous master mode. On the launch edges, the
+ * next TX bit is driven; on the other edges, the RX data is to be sampled,
+ * which the caller does once it has released queue_tx_lock, so receiving never
+ * runs under it.
+ * Must be called with queue_tx_lock held.
+ * @param current_time time of the edge
+ * @param must_sample where whether the RX data must be sampled is written to
+ * @return true while there is something to send.
+ */
+static bool handle_sync_master(ktime_t current_time, bool* must_sample)
+{
+  int idle_clock = (sync_mode & SOFT_UART_SYNC_CPOL) ? 1 : 0;
+  bool cpha = (sync_mode & SOFT_UART_SYNC_CPHA) != 0;
+  int level;
+
+  if (!sync_sample_phase)
+  {
+    level = tx_next_bit(current_time);
+    if (level < 0)
+    {
+      gpiod_set_raw_value(gpio_clk_desc, idle_clock);
+      return false;
+    }
+    gpiod_set_raw_value(gpio_tx_desc, level);
+    gpiod_set_raw_value(gpio_clk_desc, cpha ? !idle_clock : idle_clock);
+    sync_sample_phase = true;
+  }
+  else
+  {
+    gpiod_set_raw_value(gpio_clk_desc, cpha ? idle_clock : !idle_clock);
+    *must_sample = true;
+    sync_sample_phase = false;
+  }
+  return true;
+}
+
+/**
+ * Sends the next IrDA bit, or ends the pulse in progress. A 0 bit is a high
+ * pulse at the beginning of the bit period. A 1 bit leaves the line low.
+ * Must be called with queue_tx_lock held.
+ * @param current_time current time
+ * @param interval where the time until the next call is written to
+ * @return true while there is something to send.
+ */
+static bool handle_irda_tx(ktime_t current_time, ktime_t* interval)
+{
+  int level;
+
+  if (tx_pulse_on)
+  {
+    gpiod_set_raw_value(gpio_tx_desc, 0);
+    tx_pulse_on = false;
+    *interval = ktime_sub(period, pulse_width);
+    return tx.bit_index != -1 || get_tx_size() > 0;
+  }
+
+  level = tx_next_bit(current_time);
+  if (level < 0)
+  {
+    return false;
+  }
+  if (level == 0)
+  {
+    gpiod_set_raw_value(gpio_tx_desc, 1);
+    tx_pulse_on = true;
+    *interval = pulse_width;
+    return true;
+  }
+  *interval = period;
+  return tx.bit_index != -1 || get_tx_size() > 0;
+}
+
+/**
+ * Records an IrDA RX pulse. The first pulse is the start bit: its timestamp
+ * is the reference for the following pulses, and the frame is decoded once
+ * all of its bits have elapsed.
+ * @param current_time time of the pulse
+ */
+static void handle_irda_pulse(ktime_t current_time)
+{
+  s64 elapsed;
+  unsigned int slot;
+
+  if (!rx_frame_active)
+  {
+    rx_frame_active = true;
+    rx_start_time = current_time;
+    rx_pulse_slots = 1;
+    hrtimer_start(
+      &timer_rx,
+      ns_to_ktime((char_format.final_stop_bit_index + 1) * ktime_to_ns(period) + ktime_to_ns(half_period)),
+      HRTIMER_MODE_REL);
+    return;
+  }
+
+  // The pulse marks the nearest bit slot.
+  elapsed = ktime_to_ns(ktime_sub(current_time, rx_start_time));
+  if (elapsed >= 0 && elapsed < (char_format.final_stop_bit_index + 2) * ktime_to_ns(period))
+  {
+    slot = ((u32) elapsed + (u32) ktime_to_ns(half_period)) / (u32) ktime_to_ns(period);
+    rx_pulse_slots |= 1u << slot;
+  }
+}
+
+/**
+ * Feeds the bits of the IrDA frame in progress into the RX state machine. A
+ * slot with a pulse is a 0 bit, and a slot without one is a 1 bit.
+ */
+static void decode_irda_frame(void)
+{
+  int slot;
+
+  rx.bit_index = -1;
+  for (slot = 0; slot <= char_format.final_stop_bit_index + 1; slot++)
+  {
+    rx_next_bit((rx_pulse_slots & (1u << slot)) ? 0 : 1);
+  }
+  rx_frame_active = false;
+}
+
+/**
+ * Sends the next half of a Manchester bit: the complement of the bit, then the
+ * bit itself. After the last bit, the line returns to idle (low).
+ * Must be called with queue_tx_lock held.
+ * @param current_time current time
+ * @param interval where the time until the next call is written to
+ * @return true while there is something to send.
+ */
+static bool handle_manchester_tx(ktime_t current_time, ktime_t* interval)
+{
+  int level;
+
+  *interval = half_period;
+  if (tx_second_half)
+  {
+    gpiod_set_raw_value(gpio_tx_desc, tx_manchester_bit);
+    tx_second_half = false;
+    return true;
+  }
+
+  level = tx_next_bit(current_time);
+  if (level < 0)
+  {
+    gpiod_set_raw_value(gpio_tx_desc, 0);
+    return false;
+  }
+  gpiod_set_raw_value(gpio_tx_desc, !level);
+  tx_manchester_bit = level;
+  tx_second_half = true;
+  return true;
+}
+
+/**
+ * Decodes a Manchester RX edge. An edge about one bit period after the last
+ * mid-bit edge is the next mid-bit edge, and its direction is the bit. An edge
+ * about half a period after it is a bit boundary, which carries nothing. A
+ * longer silence ends the character in progress; the next falling edge is
+ * then the middle of a start bit.
+ * @param current_time time of the edge
+ * @param level level of the line after the edge
+ */
+static void handle_manchester_edge(ktime_t current_time, int level)
+{
+  s64 elapsed = ktime_to_ns(ktime_sub(current_time, rx_last_mid));
+  s64 bit_time = ktime_to_ns(period);
+
+  // Edges closer to the previous one than the glitch width are noise.
+  if (ktime_to_ns(ktime_sub(current_time, rx_last_edge)) < ktime_to_ns(rx_glitch))
+  {
+    counters.glitches++;
+    return;
+  }
+  rx_last_edge = current_time;
+
+  if (elapsed < bit_time * 3 / 4)
+  {
+    return;
+  }
+
+  if (rx.bit_index != -1 && elapsed < bit_time * 3 / 2)
+  {
+    rx_last_mid = current_time;
+    rx_next_bit(level);
+    return;
+  }
+
+  // Otherwise, the character in progress (if any) has lost the clock, and a
+  // falling edge starts the next one.
+  rx.bit_index = -1;
+  if (level == 0)
+  {
+    rx_last_mid = current_time;
+    rx_start_time = ktime_sub(current_time, half_period);
+    rx_next_bit(0);
+  }
+}
+
+/**
+ * Tells whether an edge of the clock, which left the clock at a given level,
+ * is an edge on which TX data is launched (as opposed to sampled).
+ * @param clock_level level of the clock after the edge
+ * @return true for a launch edge.
+ */
+static bool is_launch_edge(int clock_level)
+{
+  int idle_clock = (sync_mode & SOFT_UART_SYNC_CPOL) ? 1 : 0;
+  bool leading = (clock_level != idle_clock);
+  bool cpha = (sync_mode & SOFT_UART_SYNC_CPHA) != 0;
+  return cpha ? leading : !leading;
+}
+
+/**
+ * Samples the RX data on a sampling clock edge. A low level while waiting for
+ * a character is its start bit.
+ * @param current_time time of the edge
+ */
+static void sample_sync_rx(ktime_t current_time)
+{
+  int bit_value = gpiod_get_raw_value(gpio_rx_desc);
+
+  if (rx.bit_index == -1)
+  {
+    if (bit_value != 0)
+    {
+      return;
+    }
+    rx_start_time = current_time;
+  }
+  rx_next_bit(bit_value);
+}
+
+/**
+ * Produces the next bit of the character being sent. At the end of a character,
+ * dequeues the next one. Must be called with queue_tx_lock held.
+ * @param current_time time at which the bit is driven
+ * @return The level of the bit. -1 if there is nothing to send.
+ */
+static int tx_next_bit(ktime_t current_time)
+{
+  int level;
+  bool packet_done = false;
+  
+  // Start bit.
+  if (tx.bit_index == -1)
+  {
+    if (!dequeue_tx(&tx.character))
+    {
+      return -1;
+    }
+    counters.tx++;
+    if (tx_character_is_first)
+    {
+      tx_packet.first_start = current_time;
+    }
+
+    // Copies the character to the monitor taps.
+    raw_device_push_tx(tx.character, current_time);
+  }
+
+  level = soft_uart_core_tx_next_bit(&tx, &char_format);
+
+  // Final stop bit.
+  if (tx.bit_index == -1 && tx_character_is_last)
+  {
+    tx_packet.last_stop = current_time;
+    tx_packet.done = true;
+    tx_character_is_last = false;
+    packet_done = true;
+  }
+
+  // Wakes up the sender of the packet.
+  if (packet_done)
+  {
+    wake_up_interruptible(&tx_packet_wait);
+  }
+  
+  return level;
+}
+
+/**
+ * Feeds a given sampled bit into the RX state machine. The first bit of a
+ * character is its start bit. At the final stop bit, the character is received.
+ * @param bit_value level of the RX line at the sampling point
+ * @return true while a character is in progress. false once it has ended.
+ */
+static bool rx_next_bit(int bit_value)
+{
+  int result = soft_uart_core_rx_next_bit(&rx, &char_format, bit_value);
+
+  if (!(result & SOFT_UART_CORE_RX_END))
+  {
+    return true;
+  }
+
+  // Framing errors are counted in a row, to detect a receiver that is not
+  // locked on the real start bits.
+  if (result & SOFT_UART_CORE_RX_FRAME_ERROR)
+  {
+    counters.frame++;
+    rx_frame_errors_in_row++;
+  }
+  else
+  {
+    rx_frame_errors_in_row = 0;
+    if (result & SOFT_UART_CORE_RX_PARITY_ERROR)
+    {
+      counters.parity++;
+    }
+    if (result & SOFT_UART_CORE_RX_VALID)
+    {
+      receive_character(rx.character, rx_start_time);
+    }
+  }
+  return false;
+}
+
+/**
+ * Adds a given (received) character to the RX buffer, from which it is pushed
+ * to the TTY. Characters are only dropped (and counted as buffer overruns)
+ * when the RX buffer is full.
  * @param character given character
+ * @param timestamp time of the falling edge of the start bit
  */
-void receive_character(unsigned char character)
+void receive_character(unsigned char character, ktime_t timestamp)
 {
-  mutex_lock(&current_tty_mutex);
+  int frame_size;
+
+  counters.rx++;
+
+  raw_device_push(character, timestamp);
+
   if (rx_callback != NULL) {
 	  (*rx_callback)(character);
   } else {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
-    if (current_tty != NULL && current_tty->port != NULL)
+    spin_lock(&rx_buffer_lock);
+    if (framing_mode == SOFT_UART_FRAMING_NONE)
     {
-      tty_insert_flip_char(current_tty->port, character, TTY_NORMAL);
-      tty_flip_buffer_push(current_tty->port);
+      push_rx_string(&character, 1);
     }
-#else
-    if (tty != NULL)
+    else
     {
-      tty_insert_flip_char(current_tty, character, TTY_NORMAL);
-      tty_flip_buffer_push(tty);
+      frame_size = framing_decode(&rx_framing, character);
+      if (frame_size >= 0)
+      {
+        push_rx_frame(rx_framing.data, frame_size);
+      }
+      else if (frame_size == FRAMING_BAD_FRAME)
+      {
+        counters.bad_frames++;
+      }
     }
+    spin_unlock(&rx_buffer_lock);
+  }
+}
+
+/**
+ * Adds a given string to the RX buffer as a whole, and schedules pushing it to
+ * the TTY. If it does not fit, it is dropped and counted as buffer overrun.
+ * Must be called with rx_buffer_lock held.
+ * @param string given string
+ * @param string_size size of the given string
+ */
+static void push_rx_string(const unsigned char* string, int string_size)
+{
+  int i;
+
+  if (rx_buffer == NULL)
+  {
+    return;
+  }
+
+  if (rx_buffer_size - (rx_head - rx_tail) < string_size)
+  {
+    counters.buf_overrun += string_size;
+    return;
+  }
+
+  for (i = 0; i < string_size; i++)
+  {
+    rx_buffer[rx_head & (rx_buffer_size - 1)] = string[i];
+    rx_head++;
+  }
+  if (!rx_throttled)
+  {
+    schedule_work(&rx_work);
+  }
+}
+
+/**
+ * Adds a given received frame to the RX buffer as a whole, preceded by its
+ * payload size (16 bits, little endian), so the reader can tell back-to-back
+ * frames apart, and see empty ones. If it does not fit, it is dropped and
+ * counted as buffer overrun. Must be called with rx_buffer_lock held.
+ * @param payload given payload
+ * @param payload_size size of the given payload
+ */
+static void push_rx_frame(const unsigned char* payload, int payload_size)
+{
+  unsigned char header[2] = { payload_size & 0xFF, payload_size >> 8 };
+
+  if (rx_buffer != NULL && rx_buffer_size - (rx_head - rx_tail) < sizeof(header) + payload_size)
+  {
+    counters.buf_overrun += sizeof(header) + payload_size;
+    return;
+  }
+  push_rx_string(header, sizeof(header));
+  push_rx_string(payload, payload_size);
+}
+
+/**
+ * Tells the TTY that there is room in the TX queue again, so blocked writers
+ * (and poll) are woken up.
+ * @param work
+ */
+static void wake_up_writers(struct work_struct* work)
+{
+  mutex_lock(&current_tty_mutex);
+  if (current_tty != NULL)
+  {
+    tty_wakeup(current_tty);
+  }
+  mutex_unlock(&current_tty_mutex);
+}
+
+/**
+ * Moves the contents of the RX buffer to the TTY flip buffer, which is
+ * managed by the kernel, and then flushes (flip) it. Whatever the TTY does not
+ * accept stays in the RX buffer until the next run.
+ * @param work
+ */
+static void push_rx_characters(struct work_struct* work)
+{
+  unsigned int tail;
+  unsigned int count;
+  int accepted = 0;
+
+  mutex_lock(&current_tty_mutex);
+  if (current_tty != NULL)
+  {
+    do
+    {
+      // Gets the contiguous segment at the tail of the RX buffer.
+      spin_lock_irq(&rx_buffer_lock);
+      tail = rx_tail & (rx_buffer_size - 1);
+      count = rx_throttled ? 0 : min(rx_head - rx_tail, rx_buffer_size - tail);
+      spin_unlock_irq(&rx_buffer_lock);
+
+      if (count > 0)
+      {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+        accepted = tty_insert_flip_string(current_tty->port, &rx_buffer[tail], count);
+#else
+        accepted = tty_insert_flip_string(current_tty, &rx_buffer[tail], count);
+#endif
+        spin_lock_irq(&rx_buffer_lock);
+        rx_tail += accepted;
+        spin_unlock_irq(&rx_buffer_lock);
+      }
+    } while (count > 0 && accepted > 0);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+    tty_flip_buffer_push(current_tty->port);
+#else
+    tty_flip_buffer_push(current_tty);
 #endif
   }
   mutex_unlock(&current_tty_mutex);
@@ -3,16 +3,76 @@
 
 #include <linux/tty.h>
 
-int raspberry_soft_uart_init(const int gpio_tx, const int gpio_rx);
+// Lateness histogram: bucket 0 is under 1 us, bucket i (i > 0) from 2^(i-1) us
+// to 2^i us, and the last one everything above.
+#define RASPBERRY_SOFT_UART_LATENESS_BUCKETS 8
+
+// Above this, the bit period is shorter than the timers can follow.
+#define RASPBERRY_SOFT_UART_MAX_BAUDRATE 1000000
+
+struct raspberry_soft_uart_counters
+{
+  unsigned int rx;
+  unsigned int tx;
+  unsigned int parity;
+  unsigned int buf_overrun;
+  unsigned int bad_frames;
+  unsigned int glitches;
+  unsigned int frame;
+  unsigned int relocks;
+  unsigned int last_relock_us;
+  unsigned int max_lateness_ns;
+  unsigned int lateness[RASPBERRY_SOFT_UART_LATENESS_BUCKETS];
+};
+
+// Timing of the host, measured by raspberry_soft_uart_calibrate(), and the
+// fastest baudrate of every timer driven engine that it allows (0 until the
+// first calibration).
+struct raspberry_soft_uart_calibration
+{
+  unsigned int pin_read_ns;
+  unsigned int pin_write_ns;
+  unsigned int max_lateness_ns;
+  unsigned int lateness[RASPBERRY_SOFT_UART_LATENESS_BUCKETS];
+  int max_baudrate_nrz;
+  int max_baudrate_irda;
+  int max_baudrate_manchester;
+  int max_baudrate_sync_master;
+};
+
+int raspberry_soft_uart_init(const int gpio_tx, const int gpio_rx, const int gpio_clk);
 int raspberry_soft_uart_finalize(void);
+int raspberry_soft_uart_set_pins(const int gpio_tx, const int gpio_rx);
 int raspberry_soft_uart_open(struct tty_struct* tty);
 int raspberry_soft_uart_close(void);
+int raspberry_soft_uart_open_raw(void);
+int raspberry_soft_uart_close_raw(void);
 int raspberry_soft_uart_set_baudrate(const int baudrate);
+int raspberry_soft_uart_set_glitch_filter(int glitch_ns);
 int raspberry_soft_uart_set_stop_bits(int _stop_bits);
 int raspberry_soft_uart_set_parity(int _parity_en, int parity_odd, int _ignore_parity_errors);
 int raspberry_soft_uart_send_string(const unsigned char* string, int string_size);
+int raspberry_soft_uart_flush_tx(void);
+int raspberry_soft_uart_send_frame(const unsigned char* data, int size);
+int raspberry_soft_uart_set_framing(int mode);
+int raspberry_soft_uart_get_framing(void);
+int raspberry_soft_uart_get_baudrate(void);
+const char* raspberry_soft_uart_get_engine_name(void);
+int raspberry_soft_uart_get_rx_irq(void);
+int raspberry_soft_uart_set_tx_priority(int priority);
+int raspberry_soft_uart_set_sync(int mode);
+int raspberry_soft_uart_set_coding(int coding);
+int raspberry_soft_uart_send_packet(const unsigned char* data, int size, int priority, ktime_t* first_start, ktime_t* last_stop);
+int raspberry_soft_uart_is_rx_only(void);
 int raspberry_soft_uart_get_tx_queue_room(void);
 int raspberry_soft_uart_get_tx_queue_size(void);
 int raspberry_soft_uart_set_rx_callback(void (*callback)(unsigned char));
+int raspberry_soft_uart_set_rx_buffer_size(const int size);
+int raspberry_soft_uart_set_throttle(int throttled);
+int raspberry_soft_uart_get_counters(struct raspberry_soft_uart_counters* counters);
+int raspberry_soft_uart_set_instrumentation(int enabled);
+int raspberry_soft_uart_calibrate(void);
+int raspberry_soft_uart_get_calibration(struct raspberry_soft_uart_calibration* calibration);
+int raspberry_soft_uart_get_max_baudrate(void);
 
 #endif
@@ -0,0 +1,427 @@
+
+#include "raw_device.h"
+#include "raspberry_soft_uart.h"
+#include "soft_uart.h"
+
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+/**
+ * Monitor tap: every opener of the raw device gets its own copy of the stream.
+ */
+struct raw_tap
+{
+  struct list_head list;
+  wait_queue_head_t wait;
+  void* buffer;
+  struct soft_uart_raw_control* control;
+  unsigned char* rx_ring;
+  unsigned int rx_head;
+  unsigned int rx_watermark;
+  unsigned int rx_format;
+  bool tx_enabled;
+  struct eventfd_ctx* eventfd;
+};
+
+static int  raw_device_open(struct inode*, struct file*);
+static int  raw_device_release(struct inode*, struct file*);
+static int  raw_device_mmap(struct file*, struct vm_area_struct*);
+static unsigned int raw_device_poll(struct file*, poll_table*);
+static long raw_device_ioctl(struct file*, unsigned int, unsigned long);
+static unsigned int get_rx_ring_used(struct raw_tap* tap);
+static int set_eventfd(struct raw_tap* tap, int fd);
+static void push_to_tap(struct raw_tap* tap, unsigned char character, ktime_t timestamp, __u8 flags);
+static void push(unsigned char character, ktime_t timestamp, __u8 flags);
+
+static const struct file_operations raw_device_operations = {
+  .owner          = THIS_MODULE,
+  .open           = raw_device_open,
+  .release        = raw_device_release,
+  .mmap           = raw_device_mmap,
+  .poll           = raw_device_poll,
+  .unlocked_ioctl = raw_device_ioctl,
+  .llseek         = noop_llseek
+};
+
+static struct miscdevice raw_device = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name  = SOFT_UART_RAW_NAME,
+  .fops  = &raw_device_operations,
+  .mode  = 0660
+};
+
+static DEFINE_SPINLOCK(raw_lock);
+static LIST_HEAD(taps);
+static unsigned int rx_size = 0;
+
+/**
+ * Registers the raw device.
+ * @param _rx_size size of the RX ring in bytes (rounded up to a power of two)
+ * @return 1 if the initialization is successful. 0 otherwise.
+ */
+int raw_device_init(const int _rx_size)
+{
+  rx_size = roundup_pow_of_two(max(_rx_size, 64));
+  return misc_register(&raw_device) == 0;
+}
+
+/**
+ * Deregisters the raw device.
+ */
+void raw_device_finalize(void)
+{
+  misc_deregister(&raw_device);
+}
+
+/**
+ * Copies a given (received) character to the RX ring of every tap.
+ * May be called from interrupt context.
+ * @param character given character
+ * @param timestamp time of the falling edge of the start bit
+ */
+void raw_device_push(unsigned char character, ktime_t timestamp)
+{
+  push(character, timestamp, 0);
+}
+
+/**
+ * Copies a given (transmitted) character to the RX ring of every tap that
+ * asked for the TX stream. May be called from interrupt context.
+ * @param character given character
+ * @param timestamp time of the start bit
+ */
+void raw_device_push_tx(unsigned char character, ktime_t timestamp)
+{
+  push(character, timestamp, SOFT_UART_CAPTURE_TX);
+}
+
+//-----------------------------------------------------------------------------
+// Internals
+//-----------------------------------------------------------------------------
+
+/**
+ * Copies a given character to the RX ring of every interested tap.
+ * @param character given character
+ * @param timestamp time of the start bit
+ * @param flags SOFT_UART_CAPTURE_* flags
+ */
+static void push(unsigned char character, ktime_t timestamp, __u8 flags)
+{
+  unsigned long lock_flags;
+  struct raw_tap* tap;
+
+  spin_lock_irqsave(&raw_lock, lock_flags);
+  list_for_each_entry(tap, &taps, list)
+  {
+    if (!(flags & SOFT_UART_CAPTURE_TX) || tap->tx_enabled)
+    {
+      push_to_tap(tap, character, timestamp, flags);
+    }
+  }
+  spin_unlock_irqrestore(&raw_lock, lock_flags);
+}
+
+/**
+ * Adds a given character to the RX ring of a given tap. In capture format, the
+ * character is stored along with its timestamp. Wakes up the reader (and
+ * signals its eventfd) when the watermark is reached. The head is kept in the
+ * tap, as the control page may be written by user space, and only published
+ * there. Must be called with raw_lock held.
+ * @param tap given tap
+ * @param character given character
+ * @param timestamp time of the start bit
+ * @param flags SOFT_UART_CAPTURE_* flags
+ */
+static void push_to_tap(struct raw_tap* tap, unsigned char character, ktime_t timestamp, __u8 flags)
+{
+  struct soft_uart_raw_control* control = tap->control;
+  struct soft_uart_capture_record* record;
+  unsigned char* position;
+  unsigned int used = get_rx_ring_used(tap);
+  unsigned int length = (tap->rx_format == SOFT_UART_RAW_FORMAT_CAPTURE) ? sizeof(*record) : 1;
+
+  if (used + length > rx_size)
+  {
+    control->rx_overruns++;
+    return;
+  }
+
+  // Records never wrap around, as the ring size is a multiple of their size.
+  position = &tap->rx_ring[tap->rx_head & (rx_size - 1)];
+  if (length == 1)
+  {
+    *position = character;
+  }
+  else
+  {
+    record = (struct soft_uart_capture_record*) position;
+    record->timestamp_ns = ktime_to_ns(timestamp);
+    record->character = character;
+    record->flags = flags;
+    memset(record->reserved, 0, sizeof(record->reserved));
+  }
+  tap->rx_head += length;
+  smp_store_release(&control->rx_head, tap->rx_head);
+
+  if (used < tap->rx_watermark && used + length >= tap->rx_watermark)
+  {
+    wake_up_interruptible(&tap->wait);
+    if (tap->eventfd != NULL)
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+      eventfd_signal(tap->eventfd);
+#else
+      eventfd_signal(tap->eventfd, 1);
+#endif
+    }
+  }
+}
+
+/**
+ * Gets the number of bytes in the RX ring of a given tap not yet consumed by
+ * the reader. The tail is written by user space, so it is not trusted.
+ * @param tap given tap
+ * @return number of bytes
+ */
+static unsigned int get_rx_ring_used(struct raw_tap* tap)
+{
+  unsigned int used = tap->rx_head - READ_ONCE(tap->control->rx_tail);
+  return min(used, rx_size);
+}
+
+/**
+ * Opens the raw device as a new monitor tap, allocates its RX ring and starts
+ * receiving. Taps only observe the stream, so they never interfere with the
+ * TTY or with each other. Opened read-write, the control page can be mapped
+ * writable, so the reader can advance rx_tail.
+ */
+static int raw_device_open(struct inode* inode, struct file* file)
+{
+  struct raw_tap* tap;
+
+  if ((file->f_flags & O_ACCMODE) == O_WRONLY)
+  {
+    return -EINVAL;
+  }
+
+  tap = kzalloc(sizeof(*tap), GFP_KERNEL);
+  if (tap == NULL)
+  {
+    return -ENOMEM;
+  }
+
+  tap->buffer = vmalloc_user(PAGE_SIZE + rx_size);
+  if (tap->buffer == NULL)
+  {
+    kfree(tap);
+    return -ENOMEM;
+  }
+
+  init_waitqueue_head(&tap->wait);
+  tap->control = tap->buffer;
+  tap->rx_ring = (unsigned char*) tap->buffer + PAGE_SIZE;
+  tap->rx_watermark = 1;
+  tap->rx_format = SOFT_UART_RAW_FORMAT_BYTES;
+  tap->control->rx_offset = PAGE_SIZE;
+  tap->control->rx_size = rx_size;
+  tap->control->rx_watermark = tap->rx_watermark;
+  tap->control->rx_format = tap->rx_format;
+  file->private_data = tap;
+
+  // Receiving needs the pins, which may be taken by something else.
+  if (!raspberry_soft_uart_open_raw())
+  {
+    vfree(tap->buffer);
+    kfree(tap);
+    return -EBUSY;
+  }
+
+  spin_lock_irq(&raw_lock);
+  list_add_tail(&tap->list, &taps);
+  spin_unlock_irq(&raw_lock);
+
+  return nonseekable_open(inode, file);
+}
+
+/**
+ * Stops receiving and releases the tap.
+ */
+static int raw_device_release(struct inode* inode, struct file* file)
+{
+  struct raw_tap* tap = file->private_data;
+
+  raspberry_soft_uart_close_raw();
+
+  spin_lock_irq(&raw_lock);
+  list_del(&tap->list);
+  spin_unlock_irq(&raw_lock);
+
+  set_eventfd(tap, -1);
+  vfree(tap->buffer);
+  kfree(tap);
+  return 0;
+}
+
+/**
+ * Maps the control page and the RX ring into user space.
+ */
+static int raw_device_mmap(struct file* file, struct vm_area_struct* vma)
+{
+  struct raw_tap* tap = file->private_data;
+
+  if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE + rx_size)
+  {
+    return -EINVAL;
+  }
+  return remap_vmalloc_range(vma, tap->buffer, 0);
+}
+
+/**
+ * Reports POLLIN when the RX ring holds at least the watermark number of bytes.
+ */
+static unsigned int raw_device_poll(struct file* file, poll_table* wait)
+{
+  struct raw_tap* tap = file->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(file, &tap->wait, wait);
+
+  spin_lock_irq(&raw_lock);
+  if (get_rx_ring_used(tap) >= tap->rx_watermark)
+  {
+    mask |= POLLIN | POLLRDNORM;
+  }
+  spin_unlock_irq(&raw_lock);
+
+  return mask;
+}
+
+/**
+ * Handles the raw device commands.
+ */
+static long raw_device_ioctl(struct file* file, unsigned int command, unsigned long parameter)
+{
+  struct raw_tap* tap = file->private_data;
+  int error = 0;
+  __u32 value;
+  __s32 fd;
+
+  switch (command)
+  {
+    case SOFT_UART_RAW_SET_WATERMARK:
+      if (get_user(value, (__u32 __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else if (value == 0 || value > rx_size)
+      {
+        error = -EINVAL;
+      }
+      else
+      {
+        spin_lock_irq(&raw_lock);
+        tap->rx_watermark = value;
+        tap->control->rx_watermark = value;
+        spin_unlock_irq(&raw_lock);
+        wake_up_interruptible(&tap->wait);
+      }
+      break;
+
+    case SOFT_UART_RAW_SET_FORMAT:
+      if (get_user(value, (__u32 __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else if (value != SOFT_UART_RAW_FORMAT_BYTES && value != SOFT_UART_RAW_FORMAT_CAPTURE)
+      {
+        error = -EINVAL;
+      }
+      else
+      {
+        // Discards the contents of the ring, so records start aligned.
+        spin_lock_irq(&raw_lock);
+        tap->rx_format = value;
+        tap->control->rx_format = value;
+        tap->rx_head = 0;
+        tap->control->rx_head = 0;
+        tap->control->rx_tail = 0;
+        spin_unlock_irq(&raw_lock);
+      }
+      break;
+
+    case SOFT_UART_RAW_SET_TAP_TX:
+      if (get_user(value, (__u32 __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else
+      {
+        spin_lock_irq(&raw_lock);
+        tap->tx_enabled = (value != 0);
+        spin_unlock_irq(&raw_lock);
+      }
+      break;
+
+    case SOFT_UART_RAW_SET_EVENTFD:
+      if (get_user(fd, (__s32 __user*) parameter))
+      {
+        error = -EFAULT;
+      }
+      else
+      {
+        error = set_eventfd(tap, fd);
+      }
+      break;
+
+    default:
+      error = -ENOTTY;
+      break;
+  }
+
+  return error;
+}
+
+/**
+ * Sets the eventfd signaled along with POLLIN, replacing the previous one.
+ * @param tap given tap
+ * @param fd file descriptor of the eventfd, or -1 for none
+ * @return error code.
+ */
+static int set_eventfd(struct raw_tap* tap, int fd)
+{
+  struct eventfd_ctx* eventfd = NULL;
+  struct eventfd_ctx* previous;
+
+  if (fd >= 0)
+  {
+    eventfd = eventfd_ctx_fdget(fd);
+    if (IS_ERR(eventfd))
+    {
+      return PTR_ERR(eventfd);
+    }
+  }
+
+  spin_lock_irq(&raw_lock);
+  previous = tap->eventfd;
+  tap->eventfd = eventfd;
+  spin_unlock_irq(&raw_lock);
+
+  if (previous != NULL)
+  {
+    eventfd_ctx_put(previous);
+  }
+  return 0;
+}
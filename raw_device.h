@@ -0,0 +1,11 @@
+#ifndef RAW_DEVICE_H
+#define RAW_DEVICE_H
+
+#include <linux/ktime.h>
+
+int  raw_device_init(const int rx_size);
+void raw_device_finalize(void);
+void raw_device_push(unsigned char character, ktime_t timestamp);
+void raw_device_push_tx(unsigned char character, ktime_t timestamp);
+
+#endif
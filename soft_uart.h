@@ -0,0 +1,107 @@
+#ifndef SOFT_UART_H
+#define SOFT_UART_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// Definitions shared with user space.
+
+#define SOFT_UART_IOC_MAGIC  0xB7
+
+// Name of the raw device, as it appears in /dev.
+#define SOFT_UART_RAW_NAME   "soft_uart_raw0"
+
+/**
+ * Control page of the raw device, mapped at offset 0. The RX ring follows at
+ * offset rx_offset. Head and tail are free-running counters; the position in
+ * the ring is the counter modulo rx_size.
+ */
+struct soft_uart_raw_control
+{
+  __u32 rx_head;       // Written by the driver. Writes by the reader are ignored.
+  __u32 rx_tail;       // Written by the reader (open the device read-write).
+  __u32 rx_offset;     // Offset of the RX ring in the mapping (one page).
+  __u32 rx_size;       // Size of the RX ring in bytes (power of two).
+  __u32 rx_watermark;  // Number of bytes that makes poll() report POLLIN.
+  __u32 rx_overruns;   // Number of bytes dropped because the ring was full.
+  __u32 rx_format;     // SOFT_UART_RAW_FORMAT_BYTES or SOFT_UART_RAW_FORMAT_CAPTURE.
+};
+
+// The RX ring holds the received bytes.
+#define SOFT_UART_RAW_FORMAT_BYTES    0
+
+// The RX ring holds one struct soft_uart_capture_record per received byte.
+#define SOFT_UART_RAW_FORMAT_CAPTURE  1
+
+/**
+ * Timestamped received byte, as stored in the RX ring in capture format.
+ * The timestamp is the falling edge of the start bit on CLOCK_MONOTONIC, so
+ * captures can be merged with any other stream stamped on the same clock.
+ */
+struct soft_uart_capture_record
+{
+  __u64 timestamp_ns;
+  __u8  character;
+  __u8  flags;         // SOFT_UART_CAPTURE_* flags.
+  __u8  reserved[6];
+};
+
+// The character was transmitted, not received.
+#define SOFT_UART_CAPTURE_TX  0x01
+
+// Raw device commands.
+#define SOFT_UART_RAW_SET_WATERMARK  _IOW(SOFT_UART_IOC_MAGIC, 1, __u32)
+#define SOFT_UART_RAW_SET_FORMAT     _IOW(SOFT_UART_IOC_MAGIC, 3, __u32)
+#define SOFT_UART_RAW_SET_TAP_TX     _IOW(SOFT_UART_IOC_MAGIC, 4, __u32)
+#define SOFT_UART_RAW_SET_EVENTFD    _IOW(SOFT_UART_IOC_MAGIC, 10, __s32)
+
+// Maximum size of a packet sent with SOFT_UART_SEND_PACKET.
+#define SOFT_UART_MAX_PACKET  256
+
+/**
+ * Packet sent with SOFT_UART_SEND_PACKET. The command returns once the last
+ * stop bit is on the wire, with the timestamps (CLOCK_MONOTONIC) filled in.
+ */
+struct soft_uart_packet
+{
+  __u64 data;            // Pointer to the bytes to send.
+  __u32 size;            // Number of bytes to send.
+  __u32 priority;        // SOFT_UART_TX_PRIORITY_* priority.
+  __u64 first_start_ns;  // Output: when the first start bit was driven.
+  __u64 last_stop_ns;    // Output: when the last stop bit was driven.
+};
+
+// TTY commands.
+#define SOFT_UART_SET_FRAMING        _IOW(SOFT_UART_IOC_MAGIC, 5, int)
+#define SOFT_UART_SET_TX_PRIORITY    _IOW(SOFT_UART_IOC_MAGIC, 6, int)
+#define SOFT_UART_SEND_PACKET        _IOWR(SOFT_UART_IOC_MAGIC, 7, struct soft_uart_packet)
+#define SOFT_UART_SET_SYNC           _IOW(SOFT_UART_IOC_MAGIC, 8, int)
+#define SOFT_UART_SET_CODING         _IOW(SOFT_UART_IOC_MAGIC, 9, int)
+
+// Framing modes. Frames carry a CRC-16/X.25 after the payload. The TTY
+// delivers every good frame as its payload size (16 bits, little endian)
+// followed by the payload.
+#define SOFT_UART_FRAMING_NONE  0
+#define SOFT_UART_FRAMING_SLIP  1
+#define SOFT_UART_FRAMING_COBS  2
+#define SOFT_UART_FRAMING_HDLC  3
+
+// TX queue priorities.
+#define SOFT_UART_TX_PRIORITY_NORMAL  0
+#define SOFT_UART_TX_PRIORITY_URGENT  1
+#define SOFT_UART_TX_PRIORITIES       2
+
+// Synchronous (clocked) modes: one of the modes, plus the clock flags.
+#define SOFT_UART_SYNC_OFF     0     // Asynchronous: no clock.
+#define SOFT_UART_SYNC_MASTER  1     // The clock is driven while transmitting.
+#define SOFT_UART_SYNC_SLAVE   2     // The clock is driven by the peer.
+#define SOFT_UART_SYNC_MODE    0x0F  // Mask of the mode.
+#define SOFT_UART_SYNC_CPOL    0x10  // The clock idles high.
+#define SOFT_UART_SYNC_CPHA    0x20  // Data is sampled on the trailing edge.
+
+// Line codings of the asynchronous mode.
+#define SOFT_UART_CODING_NRZ   0     // Plain UART levels.
+#define SOFT_UART_CODING_IRDA  1     // IrDA SIR: 3/16-bit pulses for 0 bits.
+#define SOFT_UART_CODING_MANCHESTER  2  // Mid-bit transitions (IEEE 802.3).
+
+#endif
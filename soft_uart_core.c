@@ -0,0 +1,290 @@
+#include "soft_uart_core.h"
+
+/**
+ * Computes the positions of the bits in a character from a given format. A
+ * character never exceeds 12 bits, whatever the format.
+ * @param frame where the positions are written to
+ * @param stop_bits number of stop bits (2, or 1 for any other value)
+ * @param parity_en 1 to enable the parity bit, 0 to disable it
+ * @param parity_odd 1 for odd parity, 0 for even parity
+ * @param ignore_parity_errors 1 to receive characters with wrong parity bit, 0 to drop them
+ */
+void soft_uart_core_set_frame(struct soft_uart_core_frame* frame, int stop_bits, int parity_en, int parity_odd, int ignore_parity_errors)
+{
+  stop_bits = (stop_bits == 2) ? 2 : 1;
+  frame->parity_init = parity_odd ? 1 : 0;
+  frame->ignore_parity_errors = ignore_parity_errors;
+  if (parity_en)
+  {
+    frame->parity_index = 8;
+    frame->final_stop_bit_index = frame->parity_index + stop_bits;
+  }
+  else
+  {
+    frame->parity_index = -1;
+    frame->final_stop_bit_index = 7 + stop_bits;
+  }
+}
+
+/**
+ * Gets the next bit of the character being sent, tx->character. While
+ * tx->bit_index is -1, the next bit is its start bit; after its final stop
+ * bit, tx->bit_index is -1 again. If the frame changes in the middle of the
+ * character, it ends at the new final stop bit at the latest.
+ * @param tx given TX state
+ * @param frame positions of the bits
+ * @return The level of the bit.
+ */
+int soft_uart_core_tx_next_bit(struct soft_uart_core_tx* tx, const struct soft_uart_core_frame* frame)
+{
+  int level = 1;
+
+  // Start bit.
+  if (tx->bit_index == -1)
+  {
+    level = 0;
+    tx->bit_index++;
+    tx->parity = frame->parity_init;
+  }
+
+  // Data bits.
+  else if (0 <= tx->bit_index && tx->bit_index < 8)
+  {
+    level = 1 & (tx->character >> tx->bit_index);
+    tx->parity ^= level;
+    tx->bit_index++;
+  }
+
+  // Parity bit (optional)
+  else if (tx->bit_index == frame->parity_index)
+  {
+    level = tx->parity;
+    tx->bit_index++;
+  }
+
+  // Stop bit(s).
+  else if (tx->bit_index < frame->final_stop_bit_index)
+  {
+    tx->bit_index++;
+  }
+  else
+  {
+    tx->bit_index = -1;
+  }
+
+  return level;
+}
+
+/**
+ * Feeds a given sampled bit into the RX state machine. While rx->bit_index is
+ * -1, the bit is a start bit. At the final stop bit, the character, in
+ * rx->character, has ended. Every bit moves the state forward, so whatever the
+ * input, and even if the frame changes in the middle of the character, it ends
+ * within 12 bits.
+ * @param rx given RX state
+ * @param frame positions of the bits
+ * @param bit_value level of the RX line at the sampling point
+ * @return SOFT_UART_CORE_RX_* flags, 0 while the character is in progress.
+ */
+int soft_uart_core_rx_next_bit(struct soft_uart_core_rx* rx, const struct soft_uart_core_frame* frame, int bit_value)
+{
+  int result = 0;
+
+  // Start bit.
+  if (rx->bit_index == -1)
+  {
+    rx->bit_index++;
+    rx->character = 0;
+    rx->parity = frame->parity_init;
+    rx->parity_ok = true;
+    rx->stop_ok = true;
+  }
+
+  // Data bits.
+  else if (0 <= rx->bit_index && rx->bit_index < 8)
+  {
+    rx->character |= (bit_value ? 1u : 0u) << rx->bit_index;
+    rx->parity ^= bit_value ? 1 : 0;
+    rx->bit_index++;
+  }
+
+  // Parity bit (optional)
+  else if (rx->bit_index == frame->parity_index)
+  {
+    if ((bit_value ? 1 : 0) != rx->parity)
+    {
+      rx->parity_ok = false;
+    }
+    rx->bit_index++;
+  }
+
+  // Extra stop bit (optional)
+  else if (rx->bit_index < frame->final_stop_bit_index)
+  {
+    rx->stop_ok &= (bit_value != 0);
+    rx->bit_index++;
+  }
+
+  // Final stop bit (or past it, after a change of frame). A low stop bit is a
+  // framing error: the character is dropped, as it was most likely not framed
+  // on its real start bit.
+  else
+  {
+    rx->stop_ok &= (bit_value != 0);
+    result = SOFT_UART_CORE_RX_END;
+    if (!rx->stop_ok)
+    {
+      result |= SOFT_UART_CORE_RX_FRAME_ERROR;
+    }
+    else
+    {
+      if (!rx->parity_ok)
+      {
+        result |= SOFT_UART_CORE_RX_PARITY_ERROR;
+      }
+      if (rx->parity_ok || frame->ignore_parity_errors)
+      {
+        result |= SOFT_UART_CORE_RX_VALID;
+      }
+    }
+    rx->bit_index = -1;
+  }
+
+  return result;
+}
+
+/**
+ * Initializes a given edge decoder.
+ * @param decoder given decoder
+ * @param frame positions of the bits
+ * @param period_ns bit period, in ns (at least 1)
+ * @param level current level of the line
+ */
+void soft_uart_core_decoder_init(struct soft_uart_core_decoder* decoder, const struct soft_uart_core_frame* frame, long long period_ns, int level)
+{
+  decoder->frame = *frame;
+  decoder->period_ns = (period_ns > 0) ? period_ns : 1;
+  decoder->rx.bit_index = -1;
+  decoder->level = level;
+  decoder->active = false;
+  decoder->characters = 0;
+  decoder->parity_errors = 0;
+  decoder->frame_errors = 0;
+  decoder->glitches = 0;
+  decoder->samples = 0;
+}
+
+/**
+ * Takes the samples of the character in progress that are due up to a given
+ * time. A start bit that is high in its middle was a glitch. The work is
+ * bounded by the length of a character, however far the given time is.
+ * @param decoder given decoder
+ * @param time given time, in ns
+ * @param character where a received character is written to
+ * @return 1 if a character has been received. 0 otherwise.
+ */
+int soft_uart_core_decode_until(struct soft_uart_core_decoder* decoder, long long time, unsigned char* character)
+{
+  int result;
+
+  while (decoder->active && decoder->sample_time <= time)
+  {
+    if (decoder->rx.bit_index == -1 && decoder->level != 0)
+    {
+      decoder->glitches++;
+      decoder->active = false;
+      return 0;
+    }
+
+    result = soft_uart_core_rx_next_bit(&decoder->rx, &decoder->frame, decoder->level);
+    decoder->sample_time += decoder->period_ns;
+    decoder->samples++;
+    if (result & SOFT_UART_CORE_RX_END)
+    {
+      decoder->active = false;
+      if (result & SOFT_UART_CORE_RX_FRAME_ERROR)
+      {
+        decoder->frame_errors++;
+      }
+      if (result & SOFT_UART_CORE_RX_PARITY_ERROR)
+      {
+        decoder->parity_errors++;
+      }
+      if (result & SOFT_UART_CORE_RX_VALID)
+      {
+        decoder->characters++;
+        *character = decoder->rx.character;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Decodes a given array of edges, in chronological order. A falling edge while
+ * idle is a start bit. A character with no edge after its last bits is only
+ * complete once soft_uart_core_decode_until() has passed its end
+ * (decoder->end_time).
+ * @param decoder given decoder
+ * @param edges given edges
+ * @param count number of given edges
+ * @param characters where the received characters are written to. Every edge
+ * completes at most one character, so it must hold count characters.
+ * @return The amount of characters received.
+ */
+int soft_uart_core_decode_edges(struct soft_uart_core_decoder* decoder, const struct soft_uart_core_edge* edges, int count, unsigned char* characters)
+{
+  int received = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    received += soft_uart_core_decode_until(decoder, edges[i].time, &characters[received]);
+
+    if (!decoder->active && edges[i].level == 0)
+    {
+      decoder->active = true;
+      decoder->rx.bit_index = -1;
+      decoder->sample_time = edges[i].time + (decoder->period_ns >> 1);
+      decoder->end_time = decoder->sample_time + (decoder->frame.final_stop_bit_index + 1) * decoder->period_ns;
+    }
+    decoder->level = edges[i].level;
+  }
+  return received;
+}
+
+/**
+ * Gets the width of the RX glitch filter: pulses shorter than that are not
+ * taken as start bits. The width never exceeds a quarter of the bit period, so
+ * a genuine start bit is always confirmed before its middle.
+ * @param glitch_ns requested width, or 0 (or less) for 1/8 of the bit period
+ * @param period_ns bit period, in ns
+ * @return The width, in ns.
+ */
+long long soft_uart_core_glitch_width(long long glitch_ns, long long period_ns)
+{
+  long long width = (glitch_ns > 0) ? glitch_ns : (period_ns >> 3);
+  long long quarter = (period_ns >> 1) >> 1;
+
+  if (width > quarter)
+  {
+    width = quarter;
+  }
+  return (width > 0) ? width : 0;
+}
+
+/**
+ * Feeds a given sampled bit into the hunt for the next frame, after the lock
+ * has been lost. Once the line has been idle (high) for a whole frame, a
+ * falling edge can only be a genuine start bit, so the hunt is over.
+ * @param mark_bits number of idle bits in a row so far, 0 when the hunt starts
+ * @param frame positions of the bits
+ * @param bit_value level of the RX line at the sampling point
+ * @return 1 while still hunting. 0 once the receiver can lock again.
+ */
+int soft_uart_core_hunt_next_bit(int* mark_bits, const struct soft_uart_core_frame* frame, int bit_value)
+{
+  *mark_bits = (bit_value != 0) ? *mark_bits + 1 : 0;
+  return *mark_bits < frame->final_stop_bit_index + 2;
+}
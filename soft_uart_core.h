@@ -0,0 +1,77 @@
+#ifndef SOFT_UART_CORE_H
+#define SOFT_UART_CORE_H
+
+// Bit level encoder and decoder, without any kernel or C library dependency,
+// so the same code runs in the module and in the user space tools.
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#endif
+
+// Results of soft_uart_core_rx_next_bit().
+#define SOFT_UART_CORE_RX_END           0x01  // The character has ended.
+#define SOFT_UART_CORE_RX_VALID         0x02  // It is to be received.
+#define SOFT_UART_CORE_RX_PARITY_ERROR  0x04
+#define SOFT_UART_CORE_RX_FRAME_ERROR   0x08
+
+// Positions of the bits in a character (8 data bits), after the start bit.
+struct soft_uart_core_frame
+{
+  int parity_init;
+  int parity_index;
+  int final_stop_bit_index;
+  int ignore_parity_errors;
+};
+
+struct soft_uart_core_tx
+{
+  unsigned char character;
+  int bit_index;
+  int parity;
+};
+
+struct soft_uart_core_rx
+{
+  int bit_index;
+  unsigned int character;
+  int parity;
+  bool parity_ok;
+  bool stop_ok;
+};
+
+struct soft_uart_core_edge
+{
+  long long time;
+  int level;
+};
+
+// Decoder of edge timestamps (ns). Between edges, the line keeps the level of
+// the last edge, and bits are sampled in the middle of their periods.
+struct soft_uart_core_decoder
+{
+  struct soft_uart_core_frame frame;
+  long long period_ns;
+  struct soft_uart_core_rx rx;
+  int level;
+  bool active;
+  long long sample_time;
+  long long end_time;
+  unsigned int characters;
+  unsigned int parity_errors;
+  unsigned int frame_errors;
+  unsigned int glitches;
+  unsigned int samples;
+};
+
+void soft_uart_core_set_frame(struct soft_uart_core_frame* frame, int stop_bits, int parity_en, int parity_odd, int ignore_parity_errors);
+int  soft_uart_core_tx_next_bit(struct soft_uart_core_tx* tx, const struct soft_uart_core_frame* frame);
+int  soft_uart_core_rx_next_bit(struct soft_uart_core_rx* rx, const struct soft_uart_core_frame* frame, int bit_value);
+void soft_uart_core_decoder_init(struct soft_uart_core_decoder* decoder, const struct soft_uart_core_frame* frame, long long period_ns, int level);
+int  soft_uart_core_decode_until(struct soft_uart_core_decoder* decoder, long long time, unsigned char* character);
+int  soft_uart_core_decode_edges(struct soft_uart_core_decoder* decoder, const struct soft_uart_core_edge* edges, int count, unsigned char* characters);
+long long soft_uart_core_glitch_width(long long glitch_ns, long long period_ns);
+int  soft_uart_core_hunt_next_bit(int* mark_bits, const struct soft_uart_core_frame* frame, int bit_value);
+
+#endif
@@ -0,0 +1,411 @@
+#include "soft_uart_core.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Start bit, 8 data bits, parity bit and 2 stop bits: bit_index never goes
+// past the second stop bit.
+#define MAX_BIT_INDEX  10
+
+// A character takes one sample per bit: no call of the decoder does more work,
+// whatever the edges and the time given.
+#define MAX_SAMPLES_PER_CALL  (MAX_BIT_INDEX + 2)
+
+// Clean characters sent after whatever came before, all of which must be
+// received.
+#define RECOVERY_FRAMES  4
+
+#define MAX_EDGES      64
+#define CANARY         0xA5
+
+/**
+ * Input being consumed, a byte at a time. Past its end, it reads as zeros.
+ */
+struct input
+{
+  const uint8_t* data;
+  size_t size;
+  size_t position;
+};
+
+static int next_byte(struct input* input);
+static void set_frame(struct soft_uart_core_frame* frame, int format);
+static int decode_edges(struct soft_uart_core_decoder* decoder, const struct soft_uart_core_edge* edges, int count,
+  unsigned char* characters);
+static int decode_until(struct soft_uart_core_decoder* decoder, long long time, unsigned char* character);
+static void check_recovery(struct soft_uart_core_decoder* decoder, struct input* input, long long* time);
+static void check_rx(const struct soft_uart_core_rx* rx);
+static void check_tx(const struct soft_uart_core_tx* tx);
+static void fail(const char* message);
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+/**
+ * Fuzz target of the bit level encoder and decoder. The input drives the edge
+ * decoder with arbitrary edge streams and sampling times, the RX and TX state
+ * machines and the hunt for the next frame with arbitrary bits, the glitch
+ * filter with arbitrary widths, and changes of frame in the middle of it all.
+ * Whatever the input, bit_index must stay within the frame, the decoder must
+ * never write more characters than edges given nor take more samples than a
+ * character per call, the hunt must end after exactly a frame of idle line,
+ * and clean characters must always be received once the line has been idle
+ * for a character.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  struct input input = { data, size, 0 };
+  struct soft_uart_core_frame frame;
+  struct soft_uart_core_decoder decoder;
+  struct soft_uart_core_edge edges[MAX_EDGES];
+  unsigned char characters[MAX_EDGES + 1];
+  unsigned char character = CANARY;
+  struct soft_uart_core_rx rx = { -1, 0, 0, true, true };
+  struct soft_uart_core_tx tx = { 0, -1, 0 };
+  long long time = 0;
+  long long period_ns;
+  long long glitch_ns;
+  long long width;
+  int mark_bits = 0;
+  int idle_bits = 0;
+  int hunting;
+  int level = 1;
+  int count;
+  int received;
+  int operation;
+  int i;
+
+  set_frame(&frame, next_byte(&input));
+  period_ns = next_byte(&input) << 8 | next_byte(&input);
+  soft_uart_core_decoder_init(&decoder, &frame, period_ns, level);
+
+  while (input.position < input.size)
+  {
+    operation = next_byte(&input);
+    switch (operation & 0x0F)
+    {
+      // A run of edges, in chronological order.
+      case 0:
+      case 1:
+        count = next_byte(&input) % (MAX_EDGES + 1);
+        for (i = 0; i < count; i++)
+        {
+          time += next_byte(&input) << 8 | next_byte(&input);
+          level = (operation & 0x80) ? (next_byte(&input) & 1) : !level;
+          edges[i].time = time;
+          edges[i].level = level;
+        }
+        memset(characters, CANARY, sizeof(characters));
+        received = decode_edges(&decoder, edges, count, characters);
+        if (received < 0 || received > count)
+        {
+          fail("decode_edges received more characters than edges");
+        }
+        if (characters[count] != CANARY)
+        {
+          fail("decode_edges wrote past the given characters");
+        }
+        break;
+
+      // The samples due up to a given time.
+      case 2:
+        time += (long long) next_byte(&input) << 16 | next_byte(&input) << 8 | next_byte(&input);
+        received = decode_until(&decoder, (operation & 0x80) ? time : LLONG_MAX, &character);
+        if (received != 0 && received != 1)
+        {
+          fail("decode_until received more than one character");
+        }
+        break;
+
+      // A change of frame, in the decoder and in the state machines.
+      case 3:
+        set_frame(&frame, next_byte(&input));
+        decoder.frame = frame;
+        break;
+
+      // A sampled bit.
+      case 4:
+        soft_uart_core_rx_next_bit(&rx, &frame, operation & 0x80);
+        break;
+
+      // A sent bit.
+      case 5:
+        if (tx.bit_index == -1)
+        {
+          tx.character = next_byte(&input);
+        }
+        level = soft_uart_core_tx_next_bit(&tx, &frame);
+        if (level != 0 && level != 1)
+        {
+          fail("tx_next_bit returned a level other than 0 or 1");
+        }
+        break;
+
+      // Clean characters, after whatever came before.
+      case 6:
+        check_recovery(&decoder, &input, &time);
+        break;
+
+      // Sampled bits (or a run of idle bits), while hunting for the next
+      // frame. The hunt starts over once it is over.
+      case 7:
+        count = (operation & 0x80) ? next_byte(&input) : 0xFF;
+        for (i = 0; i < 8; i++)
+        {
+          level = (count & (0x80 >> i)) != 0;
+          idle_bits = level ? idle_bits + 1 : 0;
+          hunting = soft_uart_core_hunt_next_bit(&mark_bits, &frame, level);
+          if (hunting != (idle_bits < frame.final_stop_bit_index + 2))
+          {
+            fail("the hunt did not end after exactly a frame of idle line");
+          }
+          if (!hunting)
+          {
+            mark_bits = 0;
+            idle_bits = 0;
+          }
+        }
+        break;
+
+      // A glitch filter width (0 for the default one), at an arbitrary period
+      // (including 0).
+      case 8:
+        glitch_ns = (long long) next_byte(&input) << 16 | next_byte(&input) << 8 | next_byte(&input);
+        period_ns = (long long) next_byte(&input) << 16 | next_byte(&input) << 8 | next_byte(&input);
+        width = soft_uart_core_glitch_width(glitch_ns, period_ns);
+        if (width < 0 || width > (period_ns >> 2))
+        {
+          fail("glitch filter width past a quarter of the bit period");
+        }
+        if (glitch_ns > 0 && glitch_ns <= (period_ns >> 2) && width != glitch_ns)
+        {
+          fail("glitch filter width not the requested one");
+        }
+        break;
+
+      // A new decoder, at an arbitrary period (including 0).
+      default:
+        period_ns = next_byte(&input) << 8 | next_byte(&input);
+        soft_uart_core_decoder_init(&decoder, &frame, period_ns, level);
+        break;
+    }
+
+    check_rx(&decoder.rx);
+    check_rx(&rx);
+    check_tx(&tx);
+    if (decoder.period_ns <= 0)
+    {
+      fail("decoder period is not positive");
+    }
+  }
+  return 0;
+}
+
+#ifdef SOFT_UART_FUZZ_MAIN
+/**
+ * Runs the fuzz target on every file given, or on stdin, for AFL and to replay
+ * the inputs found by libFuzzer.
+ */
+int main(int argc, char** argv)
+{
+  static uint8_t data[1 << 20];
+  FILE* file;
+  size_t size;
+  int i;
+
+  for (i = (argc > 1) ? 1 : 0; i < argc; i++)
+  {
+    file = (argc > 1) ? fopen(argv[i], "rb") : stdin;
+    if (file == NULL)
+    {
+      perror(argv[i]);
+      return EXIT_FAILURE;
+    }
+    size = fread(data, 1, sizeof(data), file);
+    if (file != stdin)
+    {
+      fclose(file);
+    }
+    LLVMFuzzerTestOneInput(data, size);
+  }
+  return EXIT_SUCCESS;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Internals
+//-----------------------------------------------------------------------------
+
+/**
+ * Takes the next byte of a given input.
+ * @param input given input
+ * @return The byte. 0 past the end of the input.
+ */
+static int next_byte(struct input* input)
+{
+  return (input->position < input->size) ? input->data[input->position++] : 0;
+}
+
+/**
+ * Sets a given frame from the bits of a given format byte. Any number of stop
+ * bits may come out, as the core must cope with it.
+ * @param frame given frame
+ * @param format given format byte
+ */
+static void set_frame(struct soft_uart_core_frame* frame, int format)
+{
+  soft_uart_core_set_frame(frame, (format & 0x0F) - 4, format & 0x10, format & 0x20, format & 0x40);
+}
+
+/**
+ * Decodes a given array of edges, an edge at a time, so the work done for
+ * every edge is checked.
+ * @param decoder given decoder
+ * @param edges given edges
+ * @param count number of given edges
+ * @param characters where the received characters are written to
+ * @return The amount of characters received.
+ */
+static int decode_edges(struct soft_uart_core_decoder* decoder, const struct soft_uart_core_edge* edges, int count,
+  unsigned char* characters)
+{
+  unsigned int samples;
+  int received = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    samples = decoder->samples;
+    received += soft_uart_core_decode_edges(decoder, &edges[i], 1, &characters[received]);
+    if (decoder->samples - samples > MAX_SAMPLES_PER_CALL)
+    {
+      fail("decode_edges took more samples than a character for one edge");
+    }
+  }
+  return received;
+}
+
+/**
+ * Takes the samples that are due up to a given time, and checks the work done.
+ * @param decoder given decoder
+ * @param time given time, in ns
+ * @param character where a received character is written to
+ * @return 1 if a character has been received. 0 otherwise.
+ */
+static int decode_until(struct soft_uart_core_decoder* decoder, long long time, unsigned char* character)
+{
+  unsigned int samples = decoder->samples;
+  int received = soft_uart_core_decode_until(decoder, time, character);
+
+  if (decoder->samples - samples > MAX_SAMPLES_PER_CALL)
+  {
+    fail("decode_until took more samples than a character");
+  }
+  return received;
+}
+
+/**
+ * Checks that the decoder recovers from whatever came before: once the line
+ * has been idle for a character, RECOVERY_FRAMES clean characters, sent back
+ * to back, must all be received. Periods under 2 ns leave no room to sample
+ * the middle of a bit, so they are not checked.
+ * @param decoder given decoder
+ * @param input input the characters are taken from
+ * @param time current time, moved past the characters
+ */
+static void check_recovery(struct soft_uart_core_decoder* decoder, struct input* input, long long* time)
+{
+  struct soft_uart_core_edge edges[MAX_EDGES];
+  struct soft_uart_core_tx tx = { 0, -1, 0 };
+  unsigned char sent[RECOVERY_FRAMES];
+  unsigned char characters[MAX_EDGES + 1];
+  long long period_ns = decoder->period_ns;
+  int line = 1;
+  int count = 0;
+  int received;
+  int i;
+
+  if (period_ns < 2)
+  {
+    return;
+  }
+
+  // Back to the idle level, then idle for longer than a character.
+  if (decoder->level == 0)
+  {
+    *time += period_ns;
+    edges[0].time = *time;
+    edges[0].level = 1;
+    decode_edges(decoder, edges, 1, characters);
+  }
+  *time += (MAX_BIT_INDEX + 3) * period_ns;
+  decode_until(decoder, *time, characters);
+  if (decoder->active)
+  {
+    fail("decoder still in a character after a character of idle line");
+  }
+
+  // The edges of the characters, one bit period after the other.
+  for (i = 0; i < RECOVERY_FRAMES; i++)
+  {
+    sent[i] = next_byte(input);
+    tx.character = sent[i];
+    do
+    {
+      *time += period_ns;
+      if (soft_uart_core_tx_next_bit(&tx, &decoder->frame) != line)
+      {
+        line = !line;
+        edges[count].time = *time;
+        edges[count].level = line;
+        count++;
+      }
+    }
+    while (tx.bit_index != -1);
+  }
+  *time += period_ns;
+
+  received = decode_edges(decoder, edges, count, characters);
+  received += decode_until(decoder, *time, &characters[received]);
+  if (received != RECOVERY_FRAMES || memcmp(characters, sent, sizeof(sent)) != 0)
+  {
+    fail("clean characters not received after a character of idle line");
+  }
+}
+
+/**
+ * Checks the bounds of a given RX state.
+ * @param rx given RX state
+ */
+static void check_rx(const struct soft_uart_core_rx* rx)
+{
+  if (rx->bit_index < -1 || rx->bit_index > MAX_BIT_INDEX)
+  {
+    fail("rx bit_index out of bounds");
+  }
+}
+
+/**
+ * Checks the bounds of a given TX state.
+ * @param tx given TX state
+ */
+static void check_tx(const struct soft_uart_core_tx* tx)
+{
+  if (tx->bit_index < -1 || tx->bit_index > MAX_BIT_INDEX)
+  {
+    fail("tx bit_index out of bounds");
+  }
+}
+
+/**
+ * Reports a broken invariant, and aborts so the fuzzer keeps the input.
+ * @param message what is broken
+ */
+static void fail(const char* message)
+{
+  fprintf(stderr, "fuzz_soft_uart_core: %s.\n", message);
+  abort();
+}
@@ -0,0 +1,364 @@
+#include "soft_uart_core.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC  1000000000LL
+#define EDGES_PER_RUN 4096
+
+// Portable SIMD through the GCC vector extensions. 16 bytes is the width of
+// both NEON and SSE2, so the default builds already get the vector code.
+#define VECTOR_SIZE       16
+#define VECTORS_PER_STEP  4
+typedef unsigned char vector_t __attribute__((vector_size(VECTOR_SIZE)));
+typedef signed char mask_t __attribute__((vector_size(VECTOR_SIZE)));
+
+struct counters
+{
+  unsigned long long characters;
+  unsigned long long parity;
+  unsigned long long frame;
+  unsigned long long glitches;
+};
+
+static void usage(const char* program);
+static void decode_samples(const unsigned char* data, long long size, long long rate, int baudrate, unsigned char line,
+  const struct soft_uart_core_frame* frame);
+static void decode_edges(const unsigned char* data, long long size, int baudrate, const struct soft_uart_core_frame* frame);
+static long long find_level(const unsigned char* data, long long size, long long position, unsigned char line, int level);
+static void count_result(int result);
+static void output(long long time, unsigned char character);
+
+static struct counters counters;
+static bool text_output = false;
+
+/**
+ * Offline decoder of captured RX streams. The capture is either a stream of
+ * samples (one byte per sample, one bit per line, as logic analyzers record
+ * them) or a stream of edge timestamps (64-bit little endian ns, one per
+ * transition, starting from the idle level). The characters go to stdout.
+ */
+int main(int argc, char** argv)
+{
+  struct soft_uart_core_frame frame;
+  struct stat status;
+  const unsigned char* data;
+  long long rate = 0;
+  int baudrate = 4800;
+  int line = 0;
+  int stop_bits = 1;
+  int parity_en = 0;
+  int parity_odd = 0;
+  int option;
+  int fd;
+
+  while ((option = getopt(argc, argv, "s:l:b:p:S:t")) != -1)
+  {
+    switch (option)
+    {
+      case 's': rate = atoll(optarg); break;
+      case 'l': line = atoi(optarg); break;
+      case 'b': baudrate = atoi(optarg); break;
+      case 'p': parity_en = (optarg[0] == 'e' || optarg[0] == 'o'); parity_odd = (optarg[0] == 'o'); break;
+      case 'S': stop_bits = atoi(optarg); break;
+      case 't': text_output = true; break;
+      default: usage(argv[0]); return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1 || baudrate <= 0 || stop_bits < 1 || stop_bits > 2 || line < 0 || line > 7
+    || (rate != 0 && rate < 2LL * baudrate))
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // The whole capture is mapped: it is only read once, in order.
+  fd = open(argv[optind], O_RDONLY);
+  if (fd < 0 || fstat(fd, &status) < 0)
+  {
+    fprintf(stderr, "soft_uart_decode: Failed to open %s: %s.\n", argv[optind], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  data = (status.st_size > 0) ? mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  if (data == MAP_FAILED)
+  {
+    fprintf(stderr, "soft_uart_decode: Failed to map %s: %s.\n", argv[optind], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (data != NULL)
+  {
+    madvise((void*) data, status.st_size, MADV_SEQUENTIAL);
+  }
+
+  // Same frame parameters as the module (recalc_indices()).
+  soft_uart_core_set_frame(&frame, stop_bits, parity_en, parity_odd, 0);
+
+  if (rate > 0)
+  {
+    decode_samples(data, status.st_size, rate, baudrate, 1u << line, &frame);
+  }
+  else
+  {
+    decode_edges(data, status.st_size, baudrate, &frame);
+  }
+
+  fflush(stdout);
+  fprintf(stderr, "soft_uart_decode: %llu characters, %llu framing errors, %llu parity errors, %llu glitches.\n",
+    counters.characters, counters.frame, counters.parity, counters.glitches);
+  return EXIT_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Internals
+//-----------------------------------------------------------------------------
+
+/**
+ * Prints the usage.
+ * @param program name of the program
+ */
+static void usage(const char* program)
+{
+  fprintf(stderr, "Usage: %s [-s rate [-l line]] [-b baudrate] [-p n|e|o] [-S stop_bits] [-t] capture\n", program);
+  fprintf(stderr, "  -s rate       samples per second of a sample capture; without it, the capture holds edges\n");
+  fprintf(stderr, "  -l line       bit of the samples holding the RX line, 0 to 7 [default = 0]\n");
+  fprintf(stderr, "  -b baudrate   [default = 4800]\n");
+  fprintf(stderr, "  -p parity     none, even or odd [default = n]\n");
+  fprintf(stderr, "  -S stop_bits  1 or 2 [default = 1]\n");
+  fprintf(stderr, "  -t            text output: time of the start bit (ns) and character, one per line\n");
+}
+
+/**
+ * Decodes a stream of samples. The idle stretches, which make up most of a
+ * capture, are skipped a vector at a time; only the middle of every bit of a
+ * character is then looked at.
+ * @param data given samples
+ * @param size number of given samples
+ * @param rate samples per second
+ * @param baudrate given baud rate
+ * @param line mask of the RX line in the samples
+ * @param frame frame parameters
+ */
+static void decode_samples(const unsigned char* data, long long size, long long rate, int baudrate, unsigned char line,
+  const struct soft_uart_core_frame* frame)
+{
+  // Samples per bit, in 16.16 fixed point.
+  long long step = (rate << 16) / baudrate;
+  struct soft_uart_core_rx rx;
+  long long position = find_level(data, size, 0, line, 1);
+  long long sample;
+  int result;
+  int bit;
+
+  while ((position = find_level(data, size, position, line, 0)) < size)
+  {
+    rx.bit_index = -1;
+    result = 0;
+    for (bit = 0; !(result & SOFT_UART_CORE_RX_END); bit++)
+    {
+      sample = position + (((2 * bit + 1) * step) >> 17);
+      if (sample >= size)
+      {
+        return;
+      }
+
+      // A start bit that is high in its middle was a glitch.
+      if (bit == 0 && (data[sample] & line))
+      {
+        counters.glitches++;
+        break;
+      }
+      result = soft_uart_core_rx_next_bit(&rx, frame, (data[sample] & line) != 0);
+    }
+
+    if (result & SOFT_UART_CORE_RX_VALID)
+    {
+      output(position / rate * NSEC_PER_SEC + position % rate * NSEC_PER_SEC / rate, rx.character);
+    }
+    count_result(result);
+
+    // The next start bit comes after the stop bit, and after a framing error,
+    // once the line is idle again.
+    position = find_level(data, size, sample, line, 1);
+  }
+}
+
+/**
+ * Decodes a stream of edge timestamps with the edge decoder of the module core.
+ * @param data given timestamps (64-bit little endian ns)
+ * @param size size of the given timestamps, in bytes
+ * @param baudrate given baud rate
+ * @param frame frame parameters
+ */
+static void decode_edges(const unsigned char* data, long long size, int baudrate, const struct soft_uart_core_frame* frame)
+{
+  struct soft_uart_core_decoder decoder;
+  struct soft_uart_core_edge edges[EDGES_PER_RUN];
+  unsigned char characters[1];
+  long long count = size / sizeof(uint64_t);
+  long long first;
+  long long start = -1;
+  uint64_t time;
+  bool active;
+  int level = 1;
+  int length;
+  int i;
+
+  soft_uart_core_decoder_init(&decoder, frame, NSEC_PER_SEC / baudrate, level);
+  for (first = 0; first < count; first += length)
+  {
+    length = (count - first < EDGES_PER_RUN) ? count - first : EDGES_PER_RUN;
+    for (i = 0; i < length; i++)
+    {
+      memcpy(&time, &data[(first + i) * sizeof(uint64_t)], sizeof(time));
+      level = !level;
+      edges[i].time = le64toh(time);
+      edges[i].level = level;
+    }
+
+    // Edge by edge, to keep the time of the start bit of every character. The
+    // samples due before the edge are taken first: the edge is a start bit if
+    // it is the one that makes the decoder active.
+    for (i = 0; i < length; i++)
+    {
+      if (soft_uart_core_decode_until(&decoder, edges[i].time, characters))
+      {
+        output(start, characters[0]);
+      }
+      active = decoder.active;
+      if (soft_uart_core_decode_edges(&decoder, &edges[i], 1, characters))
+      {
+        output(start, characters[0]);
+      }
+      if (!active && decoder.active)
+      {
+        start = edges[i].time;
+      }
+    }
+  }
+
+  // The last character may have no edge after it.
+  if (soft_uart_core_decode_until(&decoder, LLONG_MAX, characters))
+  {
+    output(start, characters[0]);
+  }
+
+  counters.characters += decoder.characters;
+  counters.parity += decoder.parity_errors;
+  counters.frame += decoder.frame_errors;
+  counters.glitches += decoder.glitches;
+}
+
+/**
+ * Finds the next sample at which a given line has a given level.
+ * @param data given samples
+ * @param size number of given samples
+ * @param position where to start from
+ * @param line mask of the line in the samples
+ * @param level given level
+ * @return The position of the sample. size if there is none.
+ */
+static long long find_level(const unsigned char* data, long long size, long long position, unsigned char line, int level)
+{
+  unsigned char target = level ? line : 0;
+  vector_t lines = (vector_t) {} + line;
+  vector_t targets = (vector_t) {} + target;
+  vector_t samples;
+  mask_t found;
+  uint64_t words[VECTOR_SIZE / sizeof(uint64_t)];
+  uint64_t any;
+  unsigned int i;
+  unsigned int j;
+
+  // VECTORS_PER_STEP vectors at a time, then one vector at a time to find the
+  // vector holding the sample.
+  while (position + VECTOR_SIZE * VECTORS_PER_STEP <= size)
+  {
+    found = (mask_t) {};
+    for (j = 0; j < VECTORS_PER_STEP; j++)
+    {
+      memcpy(&samples, &data[position + j * VECTOR_SIZE], VECTOR_SIZE);
+      found |= (samples & lines) == targets;
+    }
+    memcpy(words, &found, VECTOR_SIZE);
+    any = 0;
+    for (i = 0; i < VECTOR_SIZE / sizeof(uint64_t); i++)
+    {
+      any |= words[i];
+    }
+    if (any)
+    {
+      break;
+    }
+    position += VECTOR_SIZE * VECTORS_PER_STEP;
+  }
+
+  while (position + VECTOR_SIZE <= size)
+  {
+    memcpy(&samples, &data[position], VECTOR_SIZE);
+    found = (samples & lines) == targets;
+    memcpy(words, &found, VECTOR_SIZE);
+    any = 0;
+    for (i = 0; i < VECTOR_SIZE / sizeof(uint64_t); i++)
+    {
+      any |= words[i];
+    }
+    if (any)
+    {
+      break;
+    }
+    position += VECTOR_SIZE;
+  }
+
+  while (position < size && (data[position] & line) != target)
+  {
+    position++;
+  }
+  return position;
+}
+
+/**
+ * Counts the errors of a character.
+ * @param result SOFT_UART_CORE_RX_* flags
+ */
+static void count_result(int result)
+{
+  if (result & SOFT_UART_CORE_RX_FRAME_ERROR)
+  {
+    counters.frame++;
+  }
+  if (result & SOFT_UART_CORE_RX_PARITY_ERROR)
+  {
+    counters.parity++;
+  }
+  if (result & SOFT_UART_CORE_RX_VALID)
+  {
+    counters.characters++;
+  }
+}
+
+/**
+ * Writes a received character to stdout.
+ * @param time time of its start bit (ns)
+ * @param character given character
+ */
+static void output(long long time, unsigned char character)
+{
+  if (!text_output)
+  {
+    putchar_unlocked(character);
+  }
+  else
+  {
+    printf("%lld %02x\n", time, character);
+  }
+}
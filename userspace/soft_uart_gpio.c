@@ -0,0 +1,367 @@
+#include "soft_uart_gpio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC       1000000000LL
+#define NSEC_PER_MSEC      1000000LL
+#define EVENT_BUFFER_SIZE  1024
+#define EVENTS_PER_READ    64
+#define MAX_BAUDRATE       1000000
+
+static int request_line(int chip_fd, int offset, uint64_t flags);
+static int set_level(int line_fd, int level);
+static int get_level(int line_fd);
+static void load_frame(struct soft_uart_gpio* port, struct soft_uart_core_frame* frame, long long* period_ns, unsigned int* generation);
+static int64_t get_time(void);
+static void add_time(struct timespec* time, int64_t nanoseconds);
+
+/**
+ * Opens a soft UART on two lines of a given GPIO chip. The format is 4800 8N1
+ * until changed.
+ * @param port port to be initialized
+ * @param chip path of the GPIO chip, e.g. /dev/gpiochip0
+ * @param gpio_tx offset of the TX line on the chip, -1 for an RX-only port
+ * @param gpio_rx offset of the RX line on the chip
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int soft_uart_gpio_open(struct soft_uart_gpio* port, const char* chip, int gpio_tx, int gpio_rx)
+{
+  struct soft_uart_gpio_format format = { 4800, 1, 0, 0, 0 };
+  struct soft_uart_core_frame frame = { 0, -1, 8, 0 };
+  long long period_ns = 0;
+  int chip_fd;
+
+  memset(port, 0, sizeof(*port));
+  port->tx_fd = -1;
+  port->rx_fd = -1;
+  port->tx.bit_index = -1;
+  pthread_mutex_init(&port->format_lock, NULL);
+  soft_uart_gpio_set_format(port, &format);
+
+  chip_fd = open(chip, O_RDWR | O_CLOEXEC);
+  if (chip_fd < 0)
+  {
+    return 0;
+  }
+
+  // TX: output, idle (high).
+  if (gpio_tx >= 0)
+  {
+    port->tx_fd = request_line(chip_fd, gpio_tx, GPIO_V2_LINE_FLAG_OUTPUT);
+  }
+
+  // RX: input, with kernel-timestamped events on both edges.
+  port->rx_fd = request_line(chip_fd, gpio_rx,
+    GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING);
+  close(chip_fd);
+
+  if ((gpio_tx >= 0 && port->tx_fd < 0) || port->rx_fd < 0)
+  {
+    soft_uart_gpio_close(port);
+    return 0;
+  }
+
+  load_frame(port, &frame, &period_ns, &port->rx_generation);
+  soft_uart_core_decoder_init(&port->decoder, &frame, period_ns, get_level(port->rx_fd));
+  return 1;
+}
+
+/**
+ * Closes a given port, releasing its lines.
+ * @param port given port
+ */
+void soft_uart_gpio_close(struct soft_uart_gpio* port)
+{
+  if (port->tx_fd >= 0)
+  {
+    close(port->tx_fd);
+    port->tx_fd = -1;
+  }
+  if (port->rx_fd >= 0)
+  {
+    close(port->rx_fd);
+    port->rx_fd = -1;
+  }
+  pthread_mutex_destroy(&port->format_lock);
+}
+
+/**
+ * Sets the character format of a given port. The TX and RX engines switch to
+ * it at their next character boundary.
+ * @param port given port
+ * @param format new format (8 data bits are implied)
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+int soft_uart_gpio_set_format(struct soft_uart_gpio* port, const struct soft_uart_gpio_format* format)
+{
+  if (format->baudrate <= 0 || format->baudrate > MAX_BAUDRATE
+    || format->stop_bits < 1 || format->stop_bits > 2)
+  {
+    return 0;
+  }
+
+  pthread_mutex_lock(&port->format_lock);
+  port->format = *format;
+  port->format_generation++;
+  pthread_mutex_unlock(&port->format_lock);
+  return 1;
+}
+
+/**
+ * Sends a given string, bit by bit, returning once its last stop bit has been
+ * driven. Bit boundaries are absolute deadlines on CLOCK_MONOTONIC, so a late
+ * wake-up does not delay the following bits. Characters sent back to back
+ * follow each other without idle time. For an accurate timing, the calling
+ * thread should be SCHED_FIFO.
+ * @param port given port
+ * @param data given string
+ * @param size size of the given string
+ * @return The amount of characters sent. -1 on error.
+ */
+int soft_uart_gpio_send(struct soft_uart_gpio* port, const unsigned char* data, int size)
+{
+  struct timespec deadline;
+  struct timespec now;
+  int level;
+  int i;
+
+  if (port->tx_fd < 0)
+  {
+    errno = EIO;
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  for (i = 0; i < size; i++)
+  {
+    load_frame(port, &port->tx_frame, &port->tx_period_ns, &port->tx_generation);
+
+    // After an idle time, the start bit is due now.
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec))
+    {
+      deadline = now;
+    }
+
+    port->tx.character = data[i];
+    do
+    {
+      level = soft_uart_core_tx_next_bit(&port->tx, &port->tx_frame);
+      if (!set_level(port->tx_fd, level))
+      {
+        return -1;
+      }
+      add_time(&deadline, port->tx_period_ns);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+    }
+    while (port->tx.bit_index != -1);
+
+    port->tx_characters++;
+  }
+  return size;
+}
+
+/**
+ * Receives characters. Edges are read with their kernel timestamps, and bits
+ * are sampled in the middle of their periods from them, so the latency of the
+ * calling thread does not affect the decoding. The call only wakes up at the
+ * edges, and at the end of a character that has no edge after its last bits.
+ * @param port given port
+ * @param data where the received characters are written to
+ * @param size size of the given buffer
+ * @param timeout_ms how long to wait for a character, -1 for ever
+ * @return The amount of characters received, 0 on timeout. -1 on error.
+ */
+int soft_uart_gpio_receive(struct soft_uart_gpio* port, unsigned char* data, int size, int timeout_ms)
+{
+  struct gpio_v2_line_event events[EVENTS_PER_READ];
+  struct soft_uart_core_edge edges[EVENTS_PER_READ];
+  struct pollfd poll_fd = { port->rx_fd, POLLIN, 0 };
+  struct timespec timeout;
+  int64_t deadline = (timeout_ms < 0) ? -1 : get_time() + timeout_ms * NSEC_PER_MSEC;
+  int64_t wait = -1;
+  int64_t now;
+  int count = 0;
+  int ready;
+  int length;
+  int i;
+
+  while (count == 0)
+  {
+    // Waits for the next edge, for the end of the character in progress, or
+    // for the timeout, whichever comes first. A character already past its
+    // end (the thread ran late) is not waited for at all.
+    now = get_time();
+    wait = port->decoder.active ? port->decoder.end_time - now : -1;
+    if (port->decoder.active && wait < 0)
+    {
+      wait = 0;
+    }
+    if (deadline >= 0 && (wait < 0 || deadline - now < wait))
+    {
+      wait = deadline - now;
+    }
+    if (wait < 0 && deadline >= 0)
+    {
+      wait = 0;
+    }
+    timeout.tv_sec = wait / NSEC_PER_SEC;
+    timeout.tv_nsec = wait % NSEC_PER_SEC;
+
+    ready = ppoll(&poll_fd, 1, (wait < 0) ? NULL : &timeout, NULL);
+    if (ready < 0)
+    {
+      return (errno == EINTR) ? count : -1;
+    }
+
+    if (ready == 0)
+    {
+      count += soft_uart_core_decode_until(&port->decoder, get_time(), &data[count]);
+      if (count == 0 && deadline >= 0 && get_time() >= deadline)
+      {
+        break;
+      }
+      continue;
+    }
+
+    // Every edge completes at most one character.
+    length = read(port->rx_fd, events, sizeof(events[0]) * (size < EVENTS_PER_READ ? size : EVENTS_PER_READ));
+    if (length < 0)
+    {
+      return (errno == EINTR || errno == EAGAIN) ? count : -1;
+    }
+
+    length /= sizeof(events[0]);
+    for (i = 0; i < length; i++)
+    {
+      edges[i].time = events[i].timestamp_ns;
+      edges[i].level = (events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+    }
+
+    // A new format is taken between characters.
+    if (!port->decoder.active)
+    {
+      load_frame(port, &port->decoder.frame, &port->decoder.period_ns, &port->rx_generation);
+    }
+    count += soft_uart_core_decode_edges(&port->decoder, edges, length, &data[count]);
+  }
+
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+// Internals
+//-----------------------------------------------------------------------------
+
+/**
+ * Requests a given line of a GPIO chip.
+ * @param chip_fd file descriptor of the chip
+ * @param offset offset of the line on the chip
+ * @param flags GPIO_V2_LINE_FLAG_* flags. Outputs start high (idle).
+ * @return The file descriptor of the line request. -1 on error.
+ */
+static int request_line(int chip_fd, int offset, uint64_t flags)
+{
+  struct gpio_v2_line_request request;
+
+  memset(&request, 0, sizeof(request));
+  request.offsets[0] = offset;
+  request.num_lines = 1;
+  strncpy(request.consumer, "soft_uart", sizeof(request.consumer) - 1);
+  request.config.flags = flags;
+  if (flags & GPIO_V2_LINE_FLAG_OUTPUT)
+  {
+    request.config.num_attrs = 1;
+    request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    request.config.attrs[0].attr.values = 1;
+    request.config.attrs[0].mask = 1;
+  }
+  else
+  {
+    request.event_buffer_size = EVENT_BUFFER_SIZE;
+  }
+
+  if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0)
+  {
+    return -1;
+  }
+  return request.fd;
+}
+
+/**
+ * Drives a given line.
+ * @param line_fd file descriptor of the line request
+ * @param level given level
+ * @return 1 if the operation is successful. 0 otherwise.
+ */
+static int set_level(int line_fd, int level)
+{
+  struct gpio_v2_line_values values = { level ? 1 : 0, 1 };
+  return ioctl(line_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) == 0;
+}
+
+/**
+ * Reads a given line.
+ * @param line_fd file descriptor of the line request
+ * @return The level of the line. 1 (idle) on error.
+ */
+static int get_level(int line_fd)
+{
+  struct gpio_v2_line_values values = { 0, 1 };
+  if (ioctl(line_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+  {
+    return 1;
+  }
+  return values.bits & 1;
+}
+
+/**
+ * Updates the frame parameters of an engine, if the format has changed.
+ * @param port given port
+ * @param frame frame parameters of the engine
+ * @param period_ns bit period of the engine
+ * @param generation generation of the format the parameters come from
+ */
+static void load_frame(struct soft_uart_gpio* port, struct soft_uart_core_frame* frame, long long* period_ns, unsigned int* generation)
+{
+  pthread_mutex_lock(&port->format_lock);
+  if (*generation != port->format_generation)
+  {
+    *period_ns = NSEC_PER_SEC / port->format.baudrate;
+    soft_uart_core_set_frame(frame, port->format.stop_bits, port->format.parity_en, port->format.parity_odd,
+      port->format.ignore_parity_errors);
+    *generation = port->format_generation;
+  }
+  pthread_mutex_unlock(&port->format_lock);
+}
+
+/**
+ * Gets the current time.
+ * @return The time on CLOCK_MONOTONIC (the clock of the edge timestamps), in ns.
+ */
+static int64_t get_time(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * NSEC_PER_SEC + time.tv_nsec;
+}
+
+/**
+ * Adds a given amount of nanoseconds to a given time.
+ * @param time given time
+ * @param nanoseconds given amount of nanoseconds
+ */
+static void add_time(struct timespec* time, int64_t nanoseconds)
+{
+  nanoseconds += time->tv_nsec;
+  time->tv_sec += nanoseconds / NSEC_PER_SEC;
+  time->tv_nsec = nanoseconds % NSEC_PER_SEC;
+}
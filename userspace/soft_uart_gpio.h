@@ -0,0 +1,49 @@
+#ifndef SOFT_UART_GPIO_H
+#define SOFT_UART_GPIO_H
+
+#include "soft_uart_core.h"
+
+#include <pthread.h>
+
+// Character format, as set by termios.
+struct soft_uart_gpio_format
+{
+  int baudrate;
+  int stop_bits;
+  int parity_en;
+  int parity_odd;
+  int ignore_parity_errors;
+};
+
+// Soft UART on two lines of a GPIO character device (/dev/gpiochipN). The TX
+// and RX engines may run on different threads; a new format is picked up by
+// each of them at its next character boundary.
+struct soft_uart_gpio
+{
+  int tx_fd;
+  int rx_fd;
+
+  pthread_mutex_t format_lock;
+  struct soft_uart_gpio_format format;
+  unsigned int format_generation;
+
+  // TX engine.
+  unsigned int tx_generation;
+  struct soft_uart_core_frame tx_frame;
+  long long tx_period_ns;
+  struct soft_uart_core_tx tx;
+  unsigned int tx_characters;
+
+  // RX engine. Bits are sampled from the timestamps of the edges, and the
+  // error counters are kept by the decoder.
+  unsigned int rx_generation;
+  struct soft_uart_core_decoder decoder;
+};
+
+int  soft_uart_gpio_open(struct soft_uart_gpio* port, const char* chip, int gpio_tx, int gpio_rx);
+void soft_uart_gpio_close(struct soft_uart_gpio* port);
+int  soft_uart_gpio_set_format(struct soft_uart_gpio* port, const struct soft_uart_gpio_format* format);
+int  soft_uart_gpio_send(struct soft_uart_gpio* port, const unsigned char* data, int size);
+int  soft_uart_gpio_receive(struct soft_uart_gpio* port, unsigned char* data, int size, int timeout_ms);
+
+#endif
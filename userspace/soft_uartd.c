@@ -0,0 +1,296 @@
+#include "soft_uart_gpio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE     256
+#define RX_TIMEOUT_MS   100
+
+static void usage(const char* program);
+static void* transmit(void* data);
+static void apply_termios(void);
+static int get_baudrate(speed_t speed);
+static speed_t get_speed(int baudrate);
+static void stop(int signal);
+
+static struct soft_uart_gpio port;
+static int pty_master = -1;
+static int pty_slave = -1;
+static volatile sig_atomic_t running = 1;
+static pthread_mutex_t termios_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Baud rates that can be set through termios.
+static const struct
+{
+  speed_t speed;
+  int baudrate;
+}
+speeds[] = {
+  { B50, 50 }, { B75, 75 }, { B110, 110 }, { B134, 134 }, { B150, 150 }, { B200, 200 },
+  { B300, 300 }, { B600, 600 }, { B1200, 1200 }, { B1800, 1800 }, { B2400, 2400 },
+  { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+  { B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 }, { B500000, 500000 },
+  { B576000, 576000 }, { B921600, 921600 }, { B1000000, 1000000 }
+};
+
+/**
+ * Soft UART daemon: runs the soft UART engine on two lines of a GPIO chip, and
+ * exposes it as a pseudo terminal. Applications use the pseudo terminal as the
+ * serial port, including its termios settings (baud rate, parity, stop bits).
+ */
+int main(int argc, char** argv)
+{
+  const char* chip = "/dev/gpiochip0";
+  const char* link = NULL;
+  int gpio_tx = 17;
+  int gpio_rx = 27;
+  int baudrate = 4800;
+  int priority = 50;
+  unsigned char buffer[BUFFER_SIZE];
+  struct termios termios;
+  struct sched_param sched_param;
+  pthread_attr_t attributes;
+  pthread_t tx_thread;
+  int option;
+  int size;
+
+  while ((option = getopt(argc, argv, "c:t:r:b:l:p:")) != -1)
+  {
+    switch (option)
+    {
+      case 'c': chip = optarg; break;
+      case 't': gpio_tx = atoi(optarg); break;
+      case 'r': gpio_rx = atoi(optarg); break;
+      case 'b': baudrate = atoi(optarg); break;
+      case 'l': link = optarg; break;
+      case 'p': priority = atoi(optarg); break;
+      default: usage(argv[0]); return EXIT_FAILURE;
+    }
+  }
+
+  if (get_speed(baudrate) == B0)
+  {
+    fprintf(stderr, "soft_uartd: Invalid baudrate.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!soft_uart_gpio_open(&port, chip, gpio_tx, gpio_rx))
+  {
+    fprintf(stderr, "soft_uartd: Failed to request lines %d and %d of %s: %s.\n", gpio_tx, gpio_rx, chip, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // Creates the pseudo terminal. The slave is kept open, so the master does not
+  // fail while no application has the port open.
+  pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (pty_master < 0 || grantpt(pty_master) < 0 || unlockpt(pty_master) < 0
+    || (pty_slave = open(ptsname(pty_master), O_RDWR | O_NOCTTY)) < 0)
+  {
+    fprintf(stderr, "soft_uartd: Failed to create the pseudo terminal: %s.\n", strerror(errno));
+    soft_uart_gpio_close(&port);
+    return EXIT_FAILURE;
+  }
+  tcgetattr(pty_slave, &termios);
+  cfmakeraw(&termios);
+  cfsetspeed(&termios, get_speed(baudrate));
+  tcsetattr(pty_slave, TCSANOW, &termios);
+  apply_termios();
+
+  if (link != NULL)
+  {
+    unlink(link);
+    if (symlink(ptsname(pty_master), link) < 0)
+    {
+      fprintf(stderr, "soft_uartd: Failed to create %s: %s.\n", link, strerror(errno));
+    }
+  }
+  printf("soft_uartd: %s\n", ptsname(pty_master));
+  fflush(stdout);
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  // Keeps the daemon in memory, so page faults do not delay the bits.
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+
+  // TX thread: real-time, as it times the bits itself. RX is decoded from the
+  // kernel timestamps of the edges, so it can run at the normal priority.
+  if (gpio_tx >= 0)
+  {
+    sched_param.sched_priority = priority;
+    pthread_attr_init(&attributes);
+    pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attributes, SCHED_FIFO);
+    pthread_attr_setschedparam(&attributes, &sched_param);
+    if (pthread_create(&tx_thread, &attributes, transmit, NULL) != 0)
+    {
+      fprintf(stderr, "soft_uartd: SCHED_FIFO not permitted, transmitting at the normal priority.\n");
+      pthread_create(&tx_thread, NULL, transmit, NULL);
+    }
+    pthread_attr_destroy(&attributes);
+  }
+
+  while (running)
+  {
+    // Also applies the termios settings of applications that never write.
+    apply_termios();
+    size = soft_uart_gpio_receive(&port, buffer, sizeof(buffer), RX_TIMEOUT_MS);
+    if (size < 0)
+    {
+      fprintf(stderr, "soft_uartd: Failed to receive: %s.\n", strerror(errno));
+      break;
+    }
+    if (size > 0 && write(pty_master, buffer, size) < 0)
+    {
+      fprintf(stderr, "soft_uartd: Failed to write to the pseudo terminal: %s.\n", strerror(errno));
+    }
+  }
+
+  if (link != NULL)
+  {
+    unlink(link);
+  }
+  soft_uart_gpio_close(&port);
+  return EXIT_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Internals
+//-----------------------------------------------------------------------------
+
+/**
+ * Prints the usage.
+ * @param program name of the program
+ */
+static void usage(const char* program)
+{
+  fprintf(stderr, "Usage: %s [-c chip] [-t gpio_tx] [-r gpio_rx] [-b baudrate] [-l link] [-p priority]\n", program);
+  fprintf(stderr, "  -c chip      GPIO chip [default = /dev/gpiochip0]\n");
+  fprintf(stderr, "  -t gpio_tx   TX line, -1 for an RX-only port [default = 17]\n");
+  fprintf(stderr, "  -r gpio_rx   RX line [default = 27]\n");
+  fprintf(stderr, "  -b baudrate  initial baud rate [default = 4800]\n");
+  fprintf(stderr, "  -l link      symbolic link to the pseudo terminal, e.g. /tmp/ttySOFT0\n");
+  fprintf(stderr, "  -p priority  SCHED_FIFO priority of the TX thread [default = 50]\n");
+}
+
+/**
+ * TX thread: sends whatever the applications write to the pseudo terminal.
+ * @param data unused
+ * @return NULL.
+ */
+static void* transmit(void* data)
+{
+  unsigned char buffer[BUFFER_SIZE];
+  int size;
+
+  while (running)
+  {
+    size = read(pty_master, buffer, sizeof(buffer));
+    if (size < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      fprintf(stderr, "soft_uartd: Failed to read from the pseudo terminal: %s.\n", strerror(errno));
+      break;
+    }
+    apply_termios();
+    soft_uart_gpio_send(&port, buffer, size);
+  }
+  return NULL;
+}
+
+/**
+ * Applies the termios settings of the pseudo terminal to the port, as
+ * set_termios() does in the kernel module. The master reports the settings of
+ * the slave. Called by both threads: by the TX thread before sending, and by
+ * the RX loop at least every RX_TIMEOUT_MS.
+ */
+static void apply_termios(void)
+{
+  struct soft_uart_gpio_format format;
+  struct termios termios;
+  static struct termios applied;
+
+  pthread_mutex_lock(&termios_lock);
+  if (tcgetattr(pty_master, &termios) < 0
+    || (cfgetospeed(&termios) == cfgetospeed(&applied) && termios.c_cflag == applied.c_cflag
+      && termios.c_iflag == applied.c_iflag))
+  {
+    pthread_mutex_unlock(&termios_lock);
+    return;
+  }
+  applied = termios;
+
+  if ((termios.c_cflag & CSIZE) != CS8)
+  {
+    fprintf(stderr, "soft_uartd: Invalid number of data bits.\n");
+  }
+  format.baudrate = get_baudrate(cfgetospeed(&termios));
+  format.stop_bits = (termios.c_cflag & CSTOPB) ? 2 : 1;
+  format.parity_en = (termios.c_cflag & PARENB) != 0;
+  format.parity_odd = (termios.c_cflag & PARODD) != 0;
+  format.ignore_parity_errors = (termios.c_iflag & IGNPAR) != 0;
+  if (!soft_uart_gpio_set_format(&port, &format))
+  {
+    fprintf(stderr, "soft_uartd: Invalid baudrate.\n");
+  }
+  pthread_mutex_unlock(&termios_lock);
+}
+
+/**
+ * Converts a termios speed into a baud rate.
+ * @param speed given speed (B* constant)
+ * @return The baud rate. 0 if unknown.
+ */
+static int get_baudrate(speed_t speed)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+  {
+    if (speeds[i].speed == speed)
+    {
+      return speeds[i].baudrate;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Converts a baud rate into a termios speed.
+ * @param baudrate given baud rate
+ * @return The speed (B* constant). B0 if there is none for the given baud rate.
+ */
+static speed_t get_speed(int baudrate)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+  {
+    if (speeds[i].baudrate == baudrate)
+    {
+      return speeds[i].speed;
+    }
+  }
+  return B0;
+}
+
+/**
+ * Stops the daemon.
+ * @param signal received signal
+ */
+static void stop(int signal)
+{
+  running = 0;
+}